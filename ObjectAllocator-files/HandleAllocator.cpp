@@ -0,0 +1,196 @@
+#include <mutex>
+#include "HandleAllocator.h"
+
+namespace
+{
+  const unsigned HANDLE_BITS = 32;
+  const unsigned MAX_GENERATION_BITS = 16;   // width of the use counter
+  const unsigned MIN_GENERATION_BITS = 8;    // fewer repeat a generation too soon
+
+  // Bits needed to store 0..count-1
+  unsigned bits_for(unsigned count)
+  {
+    unsigned bits;
+
+    bits = 0;
+    while (bits < HANDLE_BITS && (count - 1) >> bits)
+    {
+      ++bits;
+    }
+    return bits;
+  }
+
+  // Holds a pool lock for a whole handle operation (nothing without one)
+  std::unique_lock<std::mutex> lock_pool(std::mutex *lock)
+  {
+    return lock ? std::unique_lock<std::mutex>(*lock) : std::unique_lock<std::mutex>();
+  }
+
+  OAConfig handle_config(const OAConfig &config)
+  {
+    OAConfig result(config);
+
+    if (result.HBlockInfo_.type_ != OAConfig::hbExtended)
+    {
+      result.HBlockInfo_ = OAConfig::HeaderBlockInfo(OAConfig::hbExtended);
+    }
+    result.UseCPPMemManager_ = false;
+    result.OverflowMode_ = OAConfig::ofNone;
+    return result;
+  }
+}
+
+HandleAllocator::HandleAllocator(size_t ObjectSize, const OAConfig &config)
+  : Allocator_(ObjectSize, handle_config(config))
+{
+  OAConfig actual;
+  unsigned blocks;
+
+  actual = Allocator_.GetConfig();
+  blocks = actual.GrowthPolicy_ == OAConfig::gpGeometric ? actual.MaxObjectsPerPage_ : actual.ObjectsPerPage_;
+
+  SlotBits_ = bits_for(blocks);
+
+  // Unlimited pages: the generation keeps its full width, pages get the rest
+  if (actual.MaxPages_)
+  {
+    PageBits_ = bits_for(actual.MaxPages_);
+  }
+  else
+  {
+    PageBits_ = SlotBits_ + MAX_GENERATION_BITS < HANDLE_BITS ? HANDLE_BITS - MAX_GENERATION_BITS - SlotBits_ : 0;
+  }
+
+  // With a handful of generations a stale handle soon matches again (with
+  // one bit, every reuse would)
+  if (SlotBits_ + PageBits_ + MIN_GENERATION_BITS > HANDLE_BITS)
+  {
+    OARaise(OAException::E_NO_PAGES,
+      "HandleAllocator: pages and slots leave too few bits for a generation");
+  }
+
+  GenerationBits_ = HANDLE_BITS - SlotBits_ - PageBits_;
+  if (GenerationBits_ > MAX_GENERATION_BITS)
+  {
+    GenerationBits_ = MAX_GENERATION_BITS;
+  }
+  GenerationMask_ = (1u << GenerationBits_) - 1;
+}
+
+HandleAllocator::Handle HandleAllocator::AllocateHandle(const char *label)
+{
+  std::unique_lock<std::mutex> lock(lock_pool(Allocator_.Lock_));
+  void *object;
+  Handle handle;
+
+  // Encoded under the same lock, so a Compact can't move the block first
+  object = Allocator_.try_allocate(label);
+  if (!object)
+  {
+    Allocator_.raise_error();
+  }
+
+  // Unlimited pages can outgrow the page field
+  handle = encode(object);
+  if (handle == NULL_HANDLE)
+  {
+    Allocator_.try_free(object);
+    OARaise(OAException::E_NO_PAGES,
+      "AllocateHandle: page index does not fit in a handle");
+  }
+
+  return handle;
+}
+
+void *HandleAllocator::Resolve(Handle handle) const
+{
+  std::unique_lock<std::mutex> lock(lock_pool(Allocator_.Lock_));
+
+  return resolve(handle);
+}
+
+void HandleAllocator::FreeHandle(Handle handle)
+{
+  std::unique_lock<std::mutex> lock(lock_pool(Allocator_.Lock_));
+  void *object;
+
+  object = resolve(handle);
+  if (!object)
+  {
+    OARaise(OAException::E_MULTIPLE_FREE,
+      "FreeHandle: handle is stale (block already freed or reused)");
+  }
+
+  if (Allocator_.try_free(object) != ObjectAllocator::oaOK)
+  {
+    Allocator_.raise_error();
+  }
+}
+
+unsigned HandleAllocator::Compact(RELOCATECALLBACK fn, void *Context)
+{
+  Relocation relocation;
+
+  relocation.Self = this;
+  relocation.Callback = fn;
+  relocation.Context = Context;
+  return Allocator_.Compact(fn ? relocate : nullptr, &relocation);
+}
+
+// Resolve with the pool lock held: the block and its use count are read
+// together, so the block can't move in between
+void *HandleAllocator::resolve(Handle handle) const
+{
+  unsigned slot;
+  unsigned page;
+  unsigned usecount;
+  void *object;
+
+  slot = handle & ((1u << SlotBits_) - 1);
+  page = (handle >> SlotBits_) & ((1u << PageBits_) - 1);
+
+  object = Allocator_.block_at(page, slot);
+  if (!object)
+  {
+    return nullptr;
+  }
+
+  // A free block reports a use count of 0
+  usecount = Allocator_.use_count(object);
+  if (!usecount || generation(usecount) != handle >> (PageBits_ + SlotBits_))
+  {
+    return nullptr;
+  }
+
+  return object;
+}
+
+// Translates a block move into handles (the old block is still intact)
+void HandleAllocator::relocate(const void *From, void *To, size_t, void *Context)
+{
+  const Relocation *relocation;
+
+  relocation = static_cast<const Relocation *>(Context);
+  relocation->Callback(relocation->Self->encode(From), relocation->Self->encode(To), relocation->Context);
+}
+
+HandleAllocator::Handle HandleAllocator::encode(const void *object) const
+{
+  unsigned page;
+  unsigned slot;
+
+  if (!Allocator_.locate(object, page, slot) || (PageBits_ < HANDLE_BITS && page >> PageBits_))
+  {
+    return NULL_HANDLE;
+  }
+
+  return generation(Allocator_.use_count(object)) << (PageBits_ + SlotBits_)
+    | page << SlotBits_
+    | slot;
+}
+
+// Use counts 1, 2, ... map to generations 1..mask and wrap around past 0
+uint32_t HandleAllocator::generation(unsigned usecount) const
+{
+  return usecount ? (usecount - 1) % GenerationMask_ + 1 : 0;
+}
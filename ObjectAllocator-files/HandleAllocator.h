@@ -0,0 +1,86 @@
+//---------------------------------------------------------------------------
+#ifndef HANDLEALLOCATORH
+#define HANDLEALLOCATORH
+//---------------------------------------------------------------------------
+
+#include <cstdint>
+#include "ObjectAllocator.h"
+
+// Hands out 32-bit handles instead of raw pointers. A handle packs
+//
+//   [ generation | page index | slot ]
+//
+// from high to low bits. The slot and page fields are just wide enough for
+// ObjectsPerPage_ (MaxObjectsPerPage_ with geometric growth) and MaxPages_;
+// the generation takes what is left, at least 8 and up to 16 bits. The
+// generation is the block's extended-header use counter, so a handle goes
+// stale as soon as its block is freed and Resolve catches that in O(1). A
+// page index that is freed and reused carries on the use counters of its
+// old page, so handles into released pages go stale the same way.
+class HandleAllocator
+{
+public:
+  typedef uint32_t Handle;
+  static const Handle NULL_HANDLE = 0;   // never returned by AllocateHandle
+
+  // Defined by the client (old handle, new handle, Compact's context)
+  typedef void(*RELOCATECALLBACK)(Handle, Handle, void *);
+
+  // Builds the underlying ObjectAllocator. Extended headers are forced on
+  // (keeping any user-defined bytes) and new/delete pass-through is off.
+  // Throws E_NO_PAGES if MaxPages_ and the page size leave fewer than 8
+  // generation bits.
+  HandleAllocator(size_t ObjectSize, const OAConfig &config);
+
+  // Allocates a block and returns its handle (throws like Allocate)
+  Handle AllocateHandle(const char *label = 0);
+
+  // Block for handle, or null if the handle is stale or malformed
+  void *Resolve(Handle handle) const;
+
+  // Frees the block (throws E_MULTIPLE_FREE for a stale handle)
+  void FreeHandle(Handle handle);
+
+  bool IsValid(Handle handle) const { return Resolve(handle) != nullptr; }
+
+  // ObjectAllocator::Compact, reporting each move as old and new handle.
+  // fn must not call back into this allocator (see ObjectAllocator::Compact).
+  unsigned Compact(RELOCATECALLBACK fn, void *Context = 0);
+
+  unsigned SlotBits(void) const { return SlotBits_; }
+  unsigned PageBits(void) const { return PageBits_; }
+  unsigned GenerationBits(void) const { return GenerationBits_; }
+
+  ObjectAllocator &Allocator(void) { return Allocator_; }
+  const ObjectAllocator &Allocator(void) const { return Allocator_; }
+
+private:
+  // Make private to prevent copy construction and assignment
+  HandleAllocator(const HandleAllocator &);
+  HandleAllocator &operator=(const HandleAllocator &);
+
+  struct Relocation
+  {
+    const HandleAllocator *Self;
+    RELOCATECALLBACK Callback;
+    void *Context;
+  };
+
+  static void relocate(const void *From, void *To, size_t Size, void *Context);
+
+  // These run with the allocator's lock held (by the caller or by Compact)
+  // Handle of the live block at object (NULL_HANDLE if it doesn't fit)
+  Handle encode(const void *object) const;
+  // Block for handle, or null
+  void *resolve(Handle handle) const;
+  // Generation field for a use counter (never 0)
+  uint32_t generation(unsigned usecount) const;
+
+  ObjectAllocator Allocator_;
+  unsigned SlotBits_;
+  unsigned PageBits_;
+  unsigned GenerationBits_;
+  uint32_t GenerationMask_;
+};
+
+#endif
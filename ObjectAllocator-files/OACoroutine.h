@@ -0,0 +1,134 @@
+//---------------------------------------------------------------------------
+#ifndef OACOROUTINEH
+#define OACOROUTINEH
+//---------------------------------------------------------------------------
+
+#include "ObjectAllocator.h"
+
+// C++20 coroutine glue; empty unless the compiler has coroutines
+#if OA_COROUTINES
+
+#include <coroutine>
+#include <cstddef>
+#include <new>
+
+// Runs resumed coroutines. Post is called with the allocator lock held, so
+// it should queue the handle (not resume it inline).
+class OAExecutor
+{
+public:
+  virtual ~OAExecutor() {}
+  virtual void Post(std::coroutine_handle<> handle) = 0;
+};
+
+// Awaitable returned by ObjectAllocator::AllocateAsync. Completes at once
+// when a block is free; otherwise the coroutine waits in the pool's FIFO
+// waiter queue and is posted to the executor by the Free that serves it.
+class OAAllocateAwaiter
+{
+public:
+  OAAllocateAwaiter(ObjectAllocator &pool, OAExecutor &executor, const char *label)
+    : pool_(pool), executor_(executor)
+  {
+    waiter_.Label = label;
+    waiter_.Block = nullptr;
+    waiter_.Wake = wake;
+    waiter_.Context = this;
+  }
+
+  // The queued waiter points back here, so the awaiter never moves
+  OAAllocateAwaiter(const OAAllocateAwaiter &) = delete;
+  OAAllocateAwaiter &operator=(const OAAllocateAwaiter &) = delete;
+
+  bool await_ready(void) const { return false; }
+
+  // Queueing and the allocation attempt happen together under the pool
+  // lock, so a Free in between can't be missed. Once queued, another
+  // thread may resume the coroutine at any time: don't touch this after.
+  // A pool that can't queue completes at once (null when it is full).
+  bool await_suspend(std::coroutine_handle<> handle)
+  {
+    void *block;
+    bool queues;
+
+    handle_ = handle;
+    queues = pool_.IsWaitable();
+    block = pool_.AllocateOrQueue(waiter_);
+    if (!block && queues)
+      return true;
+
+    waiter_.Block = block;
+    return false;
+  }
+
+  void *await_resume(void) const { return waiter_.Block; }
+
+private:
+  static void wake(OAWaiter *waiter)
+  {
+    OAAllocateAwaiter *self = static_cast<OAAllocateAwaiter *>(waiter->Context);
+    self->executor_.Post(self->handle_);
+  }
+
+  ObjectAllocator &pool_;
+  OAExecutor &executor_;
+  OAWaiter waiter_;
+  std::coroutine_handle<> handle_;
+};
+
+inline OAAllocateAwaiter ObjectAllocator::AllocateAsync(OAExecutor &executor, const char *label)
+{
+  return OAAllocateAwaiter(*this, executor, label);
+}
+
+// Base for a promise_type: coroutine frames up to FrameSize bytes come from
+// one shared pool per (FrameSize, Tag); bigger frames use ::operator new.
+//
+//   struct promise_type : OAFramePool<256> { ... };
+//
+// Frames are freed on whichever thread finishes the coroutine, so the pool
+// is locked (Waitable_). It keeps per-page index stacks with debugging off,
+// so a frame's delete only checks its own page and writes no patterns.
+// Blocks keep new's alignment: after the PageHeader, a pad brings the
+// first block to alignof(max_align_t) and the frame size is rounded so
+// every block stays there.
+template <size_t FrameSize, class Tag = void>
+struct OAFramePool
+{
+  static const size_t ALIGN = alignof(std::max_align_t);
+  static const size_t PAD = (ALIGN - sizeof(PageHeader) % ALIGN) % ALIGN;
+  static const size_t BLOCK = (FrameSize + 2 * PAD + ALIGN - 1) / ALIGN * ALIGN - 2 * PAD;
+
+  static ObjectAllocator &Pool(void)
+  {
+    static ObjectAllocator pool(BLOCK, config());
+    return pool;
+  }
+
+  static void *operator new(size_t size)
+  {
+    return size <= BLOCK ? Pool().Allocate() : ::operator new(size);
+  }
+
+  static void operator delete(void *frame, size_t size)
+  {
+    if (size <= BLOCK)
+      Pool().Free(frame);
+    else
+      ::operator delete(frame);
+  }
+
+private:
+  static OAConfig config(void)
+  {
+    OAConfig config(false, DEFAULT_OBJECTS_PER_PAGE * 16, 0, false, static_cast<unsigned>(PAD));
+
+    config.FreeListType_ = OAConfig::flIndexStack;
+    config.Waitable_ = true;
+    return config;
+  }
+};
+
+#endif
+
+#endif
@@ -0,0 +1,144 @@
+#include <chrono>
+#include <cstring>
+#include "OAHistogram.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#define OA_HAVE_TSC 1
+#elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#define OA_HAVE_TSC 1
+#endif
+
+namespace OAClock
+{
+
+unsigned long long Ticks(void)
+{
+#if defined(OA_HAVE_TSC)
+  return __rdtsc();
+#else
+  return static_cast<unsigned long long>(
+    std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+}
+
+// Measures the tick rate against the steady clock over a short busy-wait
+static double calibrate(void)
+{
+#if defined(OA_HAVE_TSC)
+  typedef std::chrono::steady_clock clock;
+
+  clock::time_point start = clock::now();
+  unsigned long long startticks = Ticks();
+  clock::time_point now;
+
+  do
+  {
+    now = clock::now();
+  } while (now - start < std::chrono::milliseconds(10));
+
+  unsigned long long ticks = Ticks() - startticks;
+  double seconds = std::chrono::duration<double>(now - start).count();
+
+  return static_cast<double>(ticks) / seconds;
+#else
+  return 1e9;
+#endif
+}
+
+double TicksPerSecond(void)
+{
+  static const double rate = calibrate();
+  return rate;
+}
+
+double ToNanoseconds(unsigned long long ticks)
+{
+  return static_cast<double>(ticks) * 1e9 / TicksPerSecond();
+}
+
+} // namespace OAClock
+
+OAHistogram::OAHistogram(void)
+{
+  Reset();
+}
+
+void OAHistogram::Reset(void)
+{
+  std::memset(counts_, 0, sizeof(counts_));
+  total_ = 0;
+  sum_ = 0;
+  min_ = ~0ULL;
+  max_ = 0;
+}
+
+void OAHistogram::Merge(const OAHistogram &other)
+{
+  for (unsigned i = 0; i < BUCKETS; ++i)
+  {
+    counts_[i] += other.counts_[i];
+  }
+
+  total_ += other.total_;
+  sum_ += other.sum_;
+  if (other.min_ < min_)
+    min_ = other.min_;
+  if (other.max_ > max_)
+    max_ = other.max_;
+}
+
+double OAHistogram::Mean(void) const
+{
+  if (!total_)
+    return 0.0;
+
+  return static_cast<double>(sum_) / static_cast<double>(total_);
+}
+
+unsigned long long OAHistogram::Percentile(double p) const
+{
+  if (!total_)
+    return 0;
+
+  // Rank of the sample we are looking for (1-based)
+  double wanted = p / 100.0 * static_cast<double>(total_);
+  unsigned long long rank = static_cast<unsigned long long>(wanted);
+  if (static_cast<double>(rank) < wanted)
+    ++rank;
+  if (rank < 1)
+    rank = 1;
+
+  unsigned long long seen = 0;
+  for (unsigned i = 0; i < BUCKETS; ++i)
+  {
+    seen += counts_[i];
+    if (seen >= rank)
+    {
+      unsigned long long high = BucketHigh(i);
+      return high < max_ ? high : max_;
+    }
+  }
+
+  return max_;
+}
+
+unsigned long long OAHistogram::BucketLow(unsigned index)
+{
+  if (index < SUB_BUCKETS)
+    return index;
+
+  unsigned shift = index / SUB_BUCKETS - 1;
+  unsigned long long sub = index % SUB_BUCKETS;
+  return (SUB_BUCKETS + sub) << shift;
+}
+
+unsigned long long OAHistogram::BucketHigh(unsigned index)
+{
+  if (index < SUB_BUCKETS)
+    return index;
+
+  unsigned shift = index / SUB_BUCKETS - 1;
+  return BucketLow(index) + ((1ULL << shift) - 1);
+}
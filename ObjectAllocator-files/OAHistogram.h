@@ -0,0 +1,115 @@
+//---------------------------------------------------------------------------
+#ifndef OAHISTOGRAMH
+#define OAHISTOGRAMH
+//---------------------------------------------------------------------------
+
+#include <cstddef>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// Low-overhead timestamps for latency measurement. Ticks() reads the TSC on
+// x86/x64 and falls back to a monotonic nanosecond clock elsewhere.
+namespace OAClock
+{
+  unsigned long long Ticks(void);     // current timestamp in ticks
+  double TicksPerSecond(void);        // calibrated once, on first call
+  double ToNanoseconds(unsigned long long ticks);
+}
+
+// Log-linear (HDR-style) histogram of 64-bit values. Values below
+// SUB_BUCKETS are counted exactly; every power of two above that is split
+// into SUB_BUCKETS linear sub-buckets, so a reported value is never off by
+// more than 1/SUB_BUCKETS of itself. Recording is a few instructions and
+// never allocates.
+class OAHistogram
+{
+public:
+  static const unsigned SUB_BITS = 4;
+  static const unsigned SUB_BUCKETS = 1u << SUB_BITS;
+  static const unsigned MAGNITUDES = 64 - SUB_BITS + 1;
+  static const unsigned BUCKETS = MAGNITUDES * SUB_BUCKETS;
+
+  OAHistogram(void);
+
+  // Adds one sample
+  void Record(unsigned long long value)
+  {
+    ++counts_[BucketIndex(value)];
+    ++total_;
+    sum_ += value;
+    if (value < min_)
+      min_ = value;
+    if (value > max_)
+      max_ = value;
+  }
+
+  void Reset(void);                        // drops all samples
+  void Merge(const OAHistogram &other);    // adds other's samples to this one
+
+  unsigned long long Count(void) const { return total_; }
+  unsigned long long Min(void) const { return total_ ? min_ : 0; }
+  unsigned long long Max(void) const { return max_; }
+  double Mean(void) const;
+
+  // Smallest value v such that at least p percent of the samples are <= v
+  // (reported as the upper edge of the bucket holding v, clamped to Max)
+  unsigned long long Percentile(double p) const;
+
+  // Raw access for exporting the distribution
+  unsigned long long BucketCount(unsigned index) const { return counts_[index]; }
+  static unsigned long long BucketLow(unsigned index);
+  static unsigned long long BucketHigh(unsigned index);
+
+  // Maps a value to its bucket
+  static unsigned BucketIndex(unsigned long long value)
+  {
+    if (value < SUB_BUCKETS)
+      return static_cast<unsigned>(value);
+
+    unsigned shift = HighestBit(value) - SUB_BITS;
+    unsigned sub = static_cast<unsigned>(value >> shift) & (SUB_BUCKETS - 1);
+    return (shift + 1) * SUB_BUCKETS + sub;
+  }
+
+private:
+  // Index of the most significant set bit (value must be non-zero)
+  static unsigned HighestBit(unsigned long long value)
+  {
+#if defined(__GNUC__) || defined(__clang__)
+    return 63u - static_cast<unsigned>(__builtin_clzll(value));
+#elif defined(_MSC_VER) && defined(_WIN64)
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return static_cast<unsigned>(index);
+#elif defined(_MSC_VER)
+    unsigned long index;
+    if (_BitScanReverse(&index, static_cast<unsigned long>(value >> 32)))
+      return static_cast<unsigned>(index) + 32;
+    _BitScanReverse(&index, static_cast<unsigned long>(value));
+    return static_cast<unsigned>(index);
+#else
+    unsigned index = 0;
+    while (value >>= 1)
+      ++index;
+    return index;
+#endif
+  }
+
+  unsigned long long counts_[BUCKETS];
+  unsigned long long total_;
+  unsigned long long sum_;
+  unsigned long long min_;
+  unsigned long long max_;
+};
+
+// Latency distributions (in OAClock ticks) kept by an ObjectAllocator when
+// OAConfig::LatencyStats_ is enabled
+struct OALatencyStats
+{
+  OAHistogram Allocate_;  // whole Allocate call, including any page growth
+  OAHistogram Free_;      // whole Free call, including the debug checks
+  OAHistogram NewPage_;   // allocate_new_page alone (page-growth stalls)
+};
+
+#endif
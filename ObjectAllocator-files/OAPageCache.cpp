@@ -0,0 +1,222 @@
+#include <mutex>
+#include <new>
+#include <vector>
+#include "OAPageCache.h"
+
+namespace OAPageCache
+{
+
+namespace
+{
+  const unsigned MIN_SPAN_SHIFT = 12;       // 4 KB
+  const unsigned CLASS_STEPS = 4;           // classes per power of two (quarter steps)
+  const unsigned SPAN_CLASSES = 40 * CLASS_STEPS; // up to 1.75 * 2^51 bytes
+  const unsigned THREAD_SPANS = 4;          // per class, per thread
+  const unsigned THREAD_MAX_SHIFT = 16;     // spans past 64 KB skip the thread cache
+  const unsigned THREAD_CLASSES = (THREAD_MAX_SHIFT - MIN_SPAN_SHIFT) * CLASS_STEPS + 1;
+  const size_t DEFAULT_LIMIT = 64 * 1024 * 1024;
+
+  // Global lists. Never destroyed, so allocators that outlive static
+  // destruction can still return their pages.
+  struct GlobalCache
+  {
+    GlobalCache(void) : Cached(0), Limit(DEFAULT_LIMIT) {}
+
+    std::mutex Lock;
+    std::vector<void *> Spans[SPAN_CLASSES];
+    size_t Cached;
+    size_t Limit;
+  };
+
+  GlobalCache &global(void)
+  {
+    static GlobalCache *cache = new GlobalCache();
+
+    return *cache;
+  }
+
+  // Per-thread spans. Plain data, so it stays usable after the flusher
+  // below has run at thread exit (then Exited sends everything global).
+  struct ThreadCache
+  {
+    void *Spans[THREAD_CLASSES][THREAD_SPANS];
+    unsigned Count[THREAD_CLASSES];
+    bool Exited;
+  };
+
+  thread_local ThreadCache thread_cache;
+
+  // 2^shift plus quarter steps of it
+  size_t class_bytes(unsigned index)
+  {
+    unsigned shift;
+
+    shift = index / CLASS_STEPS + MIN_SPAN_SHIFT;
+    return (CLASS_STEPS + index % CLASS_STEPS) * ((static_cast<size_t>(1) << shift) / CLASS_STEPS);
+  }
+
+  void release_global(void *span, unsigned index);
+
+  // Moves the thread's spans to the global lists when the thread exits
+  struct ThreadFlusher
+  {
+    ~ThreadFlusher()
+    {
+      thread_cache.Exited = true;
+      for (unsigned i = 0; i < THREAD_CLASSES; ++i)
+      {
+        while (thread_cache.Count[i])
+        {
+          release_global(thread_cache.Spans[i][--thread_cache.Count[i]], i);
+        }
+      }
+    }
+  };
+
+  thread_local ThreadFlusher thread_flusher;
+
+  // Smallest class that holds bytes: 4 KB, then each power of two and the
+  // three quarter steps up to the next one (5, 6, 7, 8, 10, 12, 14, 16 KB...)
+  unsigned span_class(size_t bytes)
+  {
+    unsigned shift;
+    size_t step;
+    size_t index;
+
+    if (bytes <= class_bytes(0))
+    {
+      return 0;
+    }
+
+    // 2^shift < bytes <= 2^(shift + 1)
+    shift = MIN_SPAN_SHIFT;
+    while (shift + 1 < MIN_SPAN_SHIFT + SPAN_CLASSES / CLASS_STEPS &&
+      (static_cast<size_t>(1) << (shift + 1)) < bytes)
+    {
+      ++shift;
+    }
+
+    step = (static_cast<size_t>(1) << shift) / CLASS_STEPS;
+    index = (shift - MIN_SPAN_SHIFT) * CLASS_STEPS + (bytes - (static_cast<size_t>(1) << shift) + step - 1) / step;
+    return index < SPAN_CLASSES ? static_cast<unsigned>(index) : SPAN_CLASSES - 1;
+  }
+
+  // Drops spans, largest first, until the cache fits its limit
+  void trim_to(GlobalCache &cache, size_t limit)
+  {
+    for (unsigned i = SPAN_CLASSES; i-- > 0 && cache.Cached > limit; )
+    {
+      while (!cache.Spans[i].empty() && cache.Cached > limit)
+      {
+        delete[] static_cast<char *>(cache.Spans[i].back());
+        cache.Spans[i].pop_back();
+        cache.Cached -= class_bytes(i);
+      }
+    }
+  }
+
+  void release_global(void *span, unsigned index)
+  {
+    GlobalCache &cache = global();
+    std::lock_guard<std::mutex> guard(cache.Lock);
+
+    if (cache.Cached + class_bytes(index) > cache.Limit)
+    {
+      delete[] static_cast<char *>(span);
+      return;
+    }
+
+    cache.Spans[index].push_back(span);
+    cache.Cached += class_bytes(index);
+  }
+}
+
+size_t SpanSize(size_t bytes)
+{
+  return class_bytes(span_class(bytes));
+}
+
+void *Acquire(size_t bytes)
+{
+  unsigned index;
+  void *span;
+
+  index = span_class(bytes);
+
+  // Touching thread_flusher registers its destructor for this thread
+  if (index < THREAD_CLASSES && !thread_cache.Exited)
+  {
+    (void)&thread_flusher;
+    if (thread_cache.Count[index])
+    {
+      return thread_cache.Spans[index][--thread_cache.Count[index]];
+    }
+  }
+
+  {
+    GlobalCache &cache = global();
+    std::lock_guard<std::mutex> guard(cache.Lock);
+
+    if (!cache.Spans[index].empty())
+    {
+      span = cache.Spans[index].back();
+      cache.Spans[index].pop_back();
+      cache.Cached -= class_bytes(index);
+      return span;
+    }
+  }
+
+  return new (std::nothrow) char[class_bytes(index)];
+}
+
+void Release(void *span, size_t bytes)
+{
+  unsigned index;
+
+  index = span_class(bytes);
+
+  if (index < THREAD_CLASSES && !thread_cache.Exited &&
+    thread_cache.Count[index] < THREAD_SPANS)
+  {
+    (void)&thread_flusher;
+    thread_cache.Spans[index][thread_cache.Count[index]++] = span;
+    return;
+  }
+
+  release_global(span, index);
+}
+
+size_t CachedBytes(void)
+{
+  GlobalCache &cache = global();
+  std::lock_guard<std::mutex> guard(cache.Lock);
+
+  return cache.Cached;
+}
+
+size_t Limit(void)
+{
+  GlobalCache &cache = global();
+  std::lock_guard<std::mutex> guard(cache.Lock);
+
+  return cache.Limit;
+}
+
+void SetLimit(size_t bytes)
+{
+  GlobalCache &cache = global();
+  std::lock_guard<std::mutex> guard(cache.Lock);
+
+  cache.Limit = bytes;
+  trim_to(cache, bytes);
+}
+
+void Trim(void)
+{
+  GlobalCache &cache = global();
+  std::lock_guard<std::mutex> guard(cache.Lock);
+
+  trim_to(cache, 0);
+}
+
+}
@@ -0,0 +1,33 @@
+//---------------------------------------------------------------------------
+#ifndef OAPAGECACHEH
+#define OAPAGECACHEH
+//---------------------------------------------------------------------------
+
+#include <cstddef>
+
+// Process-wide cache of page memory shared by every ObjectAllocator with
+// UsePageCache_. Requests are rounded up to a span size class: 4 KB, then
+// every power of two and the quarter steps between (5, 6, 7, 8, 10, 12 KB
+// and so on), so pools with similar page sizes reuse each other's spans
+// instead of going back to the system heap. Past 4 KB a span wastes under
+// a fifth of itself (a 4100-byte page gets 5 KB); a smaller page still
+// takes a whole 4 KB span.
+//
+// Each thread keeps a few small spans per size for itself (no locking);
+// the rest sit on global lists behind a mutex, up to Limit bytes. Spans
+// past the limit go back to the heap. A thread's spans move to the
+// global lists when it exits.
+namespace OAPageCache
+{
+  size_t SpanSize(size_t bytes);            // span a request of bytes gets
+
+  void *Acquire(size_t bytes);              // null if the heap is exhausted
+  void Release(void *span, size_t bytes);   // bytes as passed to Acquire
+
+  size_t CachedBytes(void);                 // bytes on the global lists
+  size_t Limit(void);
+  void SetLimit(size_t bytes);              // default 64 MB; trims at once
+  void Trim(void);                          // frees all global spans
+}
+
+#endif
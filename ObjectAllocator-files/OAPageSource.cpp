@@ -0,0 +1,463 @@
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include "OAPageCache.h"
+#include "OAPageSource.h"
+#include "OAVirtualMemory.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+  const size_t DEFAULT_HUGE_PAGE = 2 * 1024 * 1024;
+
+  // Kept at the start of a span OABufferPages got back (copied in and out,
+  // since a span need not be aligned for it)
+  struct FreeSpan
+  {
+    char *Next;
+    size_t Bytes;
+  };
+
+  size_t round_up(size_t bytes, size_t unit)
+  {
+    return (bytes + unit - 1) / unit * unit;
+  }
+
+  // What a mapping is rounded to: the OS page (POSIX) or the allocation
+  // granularity (Windows, also the largest alignment a mapping gets)
+  size_t granularity(void)
+  {
+#if defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwAllocationGranularity;
+#else
+    return OAVirtualMemory::PageSize();
+#endif
+  }
+
+  size_t query_huge_page_size(void)
+  {
+#if defined(_WIN32)
+    size_t size = GetLargePageMinimum();
+    return size ? size : DEFAULT_HUGE_PAGE;
+#elif defined(__linux__)
+    std::FILE *file = std::fopen("/proc/meminfo", "r");
+    char line[128];
+    unsigned long kb = 0;
+
+    if (!file)
+      return DEFAULT_HUGE_PAGE;
+    while (std::fgets(line, sizeof(line), file))
+    {
+      if (std::sscanf(line, "Hugepagesize: %lu kB", &kb) == 1)
+        break;
+    }
+    std::fclose(file);
+    return kb ? static_cast<size_t>(kb) * 1024 : DEFAULT_HUGE_PAGE;
+#else
+    return DEFAULT_HUGE_PAGE;
+#endif
+  }
+
+#if !defined(_WIN32)
+  // Anonymous mapping of size bytes; alignments past the OS page map
+  // extra and trim it off both ends
+  void *map_aligned(size_t size, size_t alignment, int prot, int flags)
+  {
+    size_t extra;
+    void *raw;
+    std::uintptr_t address;
+    std::uintptr_t aligned;
+
+    extra = alignment > OAVirtualMemory::PageSize() ? alignment : 0;
+    raw = mmap(nullptr, size + extra, prot, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+    if (raw == MAP_FAILED)
+      return nullptr;
+    if (!extra)
+      return raw;
+
+    address = reinterpret_cast<std::uintptr_t>(raw);
+    aligned = (address + alignment - 1) & ~(alignment - 1);
+    if (aligned > address)
+      munmap(raw, aligned - address);
+    if (aligned + size < address + size + extra)
+      munmap(reinterpret_cast<void *>(aligned + size), address + extra - aligned);
+    return reinterpret_cast<void *>(aligned);
+  }
+#endif
+}
+
+void *OAHeapPages::Acquire(size_t bytes, size_t alignment)
+{
+  char *raw;
+  std::uintptr_t aligned;
+
+  if (alignment <= alignof(std::max_align_t))
+    return new (std::nothrow) char[bytes];
+
+  // Room to align, with the pointer to delete just in front of the span
+  raw = new (std::nothrow) char[bytes + alignment + sizeof(char *)];
+  if (!raw)
+    return nullptr;
+
+  aligned = (reinterpret_cast<std::uintptr_t>(raw) + sizeof(char *) + alignment - 1) & ~(alignment - 1);
+  std::memcpy(reinterpret_cast<char *>(aligned) - sizeof(char *), &raw, sizeof(raw));
+  return reinterpret_cast<void *>(aligned);
+}
+
+void OAHeapPages::Release(void *span, size_t, size_t alignment)
+{
+  char *raw;
+
+  if (alignment <= alignof(std::max_align_t))
+  {
+    delete[] static_cast<char *>(span);
+    return;
+  }
+
+  std::memcpy(&raw, static_cast<char *>(span) - sizeof(char *), sizeof(raw));
+  delete[] raw;
+}
+
+void *OACachedPages::Acquire(size_t bytes, size_t alignment)
+{
+  return alignment <= alignof(std::max_align_t) ? OAPageCache::Acquire(bytes) : nullptr;
+}
+
+void OACachedPages::Release(void *span, size_t bytes, size_t)
+{
+  OAPageCache::Release(span, bytes);
+}
+
+void *OAMmapPages::Acquire(size_t bytes, size_t alignment)
+{
+#if defined(_WIN32)
+  if (alignment > granularity())
+    return nullptr;
+  return VirtualAlloc(nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+  return map_aligned(round_up(bytes, OAVirtualMemory::PageSize()), alignment, PROT_READ | PROT_WRITE, 0);
+#endif
+}
+
+void OAMmapPages::Release(void *span, size_t bytes, size_t)
+{
+#if defined(_WIN32)
+  (void)bytes;
+  VirtualFree(span, 0, MEM_RELEASE);
+#else
+  munmap(span, round_up(bytes, OAVirtualMemory::PageSize()));
+#endif
+}
+
+OAHugePages::OAHugePages(bool Fallback) : huge_(query_huge_page_size()), fallback_(Fallback)
+{
+}
+
+void *OAHugePages::Acquire(size_t bytes, size_t alignment)
+{
+  size_t size;
+  void *span;
+
+  size = round_up(bytes, huge_);
+  span = nullptr;
+
+#if defined(_WIN32)
+  // Large pages come aligned to their size
+  if (alignment <= huge_)
+    span = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+  if (!span && fallback_ && alignment <= granularity())
+    span = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+#if defined(MAP_HUGETLB)
+  // Huge page mappings come aligned to the huge page size
+  if (alignment <= huge_)
+  {
+    span = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (span == MAP_FAILED)
+      span = nullptr;
+  }
+#endif
+  // Normal pages, aligned so the kernel can still back them with huge ones
+  if (!span && fallback_)
+  {
+    span = map_aligned(size, alignment > huge_ ? alignment : huge_, PROT_READ | PROT_WRITE, 0);
+#if defined(MADV_HUGEPAGE)
+    if (span)
+      madvise(span, size, MADV_HUGEPAGE);
+#endif
+  }
+#endif
+
+  return span;
+}
+
+void OAHugePages::Release(void *span, size_t bytes, size_t)
+{
+#if defined(_WIN32)
+  (void)bytes;
+  VirtualFree(span, 0, MEM_RELEASE);
+#else
+  munmap(span, round_up(bytes, huge_));
+#endif
+}
+
+OAFilePages::OAFilePages(unsigned long long Capacity)
+  : file_(-1), section_(0), grows_(true), capacity_(Capacity), end_(0)
+{
+}
+
+OAFilePages::OAFilePages(const char *Path, unsigned long long Capacity) : OAFilePages(Capacity)
+{
+#if defined(_WIN32)
+  file_ = reinterpret_cast<std::intptr_t>(CreateFileA(Path, GENERIC_READ | GENERIC_WRITE, 0, nullptr,
+    CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr));
+#else
+  file_ = open(Path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+#endif
+}
+
+OAFilePages::~OAFilePages()
+{
+#if defined(_WIN32)
+  if (section_)
+    CloseHandle(reinterpret_cast<HANDLE>(section_));
+  if (file_ != -1)
+    CloseHandle(reinterpret_cast<HANDLE>(file_));
+#else
+  if (file_ != -1)
+    close(static_cast<int>(file_));
+#endif
+}
+
+bool OAFilePages::IsOpen(void) const
+{
+  return file_ != -1 || section_ != 0;
+}
+
+void *OAFilePages::Acquire(size_t bytes, size_t alignment)
+{
+  size_t size;
+  unsigned long long offset;
+  void *span;
+  bool found;
+
+  if (!IsOpen())
+    return nullptr;
+
+  size = round_up(bytes, granularity());
+  std::lock_guard<std::mutex> guard(lock_);
+
+  // A released range of the same size first, else the end of the file
+  found = false;
+  offset = 0;
+  for (size_t i = 0; i < free_.size(); ++i)
+  {
+    if (free_[i].second == size)
+    {
+      offset = free_[i].first;
+      free_[i] = free_.back();
+      free_.pop_back();
+      found = true;
+      break;
+    }
+  }
+
+  if (!found)
+  {
+    if (capacity_ && end_ + size > capacity_)
+      return nullptr;
+    offset = end_;
+#if !defined(_WIN32)
+    if (grows_ && ftruncate(static_cast<int>(file_), static_cast<off_t>(offset + size)))
+      return nullptr;
+#endif
+    end_ = offset + size;
+  }
+
+  span = map_span(offset, size, alignment);
+  if (!span)
+  {
+    free_.push_back(std::make_pair(offset, size));
+    return nullptr;
+  }
+
+  offsets_[span] = offset;
+  return span;
+}
+
+void OAFilePages::Release(void *span, size_t bytes, size_t)
+{
+  size_t size;
+  std::unordered_map<void *, unsigned long long>::iterator found;
+
+  size = round_up(bytes, granularity());
+#if defined(_WIN32)
+  UnmapViewOfFile(span);
+#else
+  munmap(span, size);
+#endif
+
+  std::lock_guard<std::mutex> guard(lock_);
+  found = offsets_.find(span);
+  if (found != offsets_.end())
+  {
+    free_.push_back(std::make_pair(found->second, size));
+    offsets_.erase(found);
+  }
+}
+
+// Maps size bytes of the file at offset (a multiple of granularity())
+void *OAFilePages::map_span(unsigned long long offset, size_t size, size_t alignment)
+{
+#if defined(_WIN32)
+  HANDLE section;
+  void *span;
+
+  if (alignment > granularity())
+    return nullptr;
+
+  // A file is mapped through a section as long as the data so far, which
+  // also extends the file; a view keeps its own reference to the section
+  section = reinterpret_cast<HANDLE>(section_);
+  if (!section_)
+  {
+    unsigned long long end = offset + size;
+
+    section = CreateFileMappingA(reinterpret_cast<HANDLE>(file_), nullptr, PAGE_READWRITE,
+      static_cast<DWORD>(end >> 32), static_cast<DWORD>(end), nullptr);
+    if (!section)
+      return nullptr;
+  }
+
+  span = MapViewOfFile(section, FILE_MAP_ALL_ACCESS, static_cast<DWORD>(offset >> 32),
+    static_cast<DWORD>(offset), size);
+  if (!section_)
+    CloseHandle(section);
+  return span;
+#else
+  void *span;
+
+  if (alignment <= OAVirtualMemory::PageSize())
+  {
+    span = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, static_cast<int>(file_),
+      static_cast<off_t>(offset));
+    return span == MAP_FAILED ? nullptr : span;
+  }
+
+  // Reserve an aligned range, then map the file over it
+  span = map_aligned(size, alignment, PROT_NONE, MAP_NORESERVE);
+  if (!span)
+    return nullptr;
+  if (mmap(span, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, static_cast<int>(file_),
+    static_cast<off_t>(offset)) == MAP_FAILED)
+  {
+    munmap(span, size);
+    return nullptr;
+  }
+  return span;
+#endif
+}
+
+OASharedPages::OASharedPages(const char *Name, unsigned long long Capacity) : OAFilePages(Capacity)
+{
+  grows_ = false;
+  if (!Capacity)
+  {
+    name_[0] = 0;
+    return;
+  }
+
+#if defined(_WIN32)
+  std::snprintf(name_, sizeof(name_), "%s", Name);
+  section_ = reinterpret_cast<std::intptr_t>(CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+    static_cast<DWORD>(Capacity >> 32), static_cast<DWORD>(Capacity), name_));
+#else
+  // POSIX names are "/name"
+  std::snprintf(name_, sizeof(name_), "%s%s", Name[0] == '/' ? "" : "/", Name);
+  file_ = shm_open(name_, O_RDWR | O_CREAT, 0600);
+  if (file_ != -1 && ftruncate(static_cast<int>(file_), static_cast<off_t>(Capacity)))
+  {
+    close(static_cast<int>(file_));
+    shm_unlink(name_);
+    file_ = -1;
+  }
+#endif
+}
+
+OASharedPages::~OASharedPages()
+{
+#if !defined(_WIN32)
+  if (IsOpen())
+    shm_unlink(name_);
+#endif
+}
+
+OABufferPages::OABufferPages(void *Buffer, size_t Bytes)
+  : buffer_(static_cast<char *>(Buffer)), size_(Buffer ? Bytes : 0), used_(0), free_(nullptr)
+{
+}
+
+size_t OABufferPages::Used(void) const
+{
+  std::lock_guard<std::mutex> guard(lock_);
+  return used_;
+}
+
+void *OABufferPages::Acquire(size_t bytes, size_t alignment)
+{
+  std::uintptr_t address;
+  size_t skip;
+  char *span;
+  char *previous;
+  FreeSpan entry;
+
+  std::lock_guard<std::mutex> guard(lock_);
+
+  // A released span of the same size and alignment first
+  previous = nullptr;
+  for (span = free_; span; span = entry.Next)
+  {
+    std::memcpy(&entry, span, sizeof(entry));
+    if (entry.Bytes == bytes && !(reinterpret_cast<std::uintptr_t>(span) % alignment))
+    {
+      if (previous)
+        std::memcpy(previous + offsetof(FreeSpan, Next), &entry.Next, sizeof(entry.Next));
+      else
+        free_ = entry.Next;
+      return span;
+    }
+    previous = span;
+  }
+
+  // Room for the link once the span comes back
+  bytes = bytes < sizeof(FreeSpan) ? sizeof(FreeSpan) : bytes;
+  address = reinterpret_cast<std::uintptr_t>(buffer_ + used_);
+  skip = (alignment - address % alignment) % alignment;
+  if (skip + bytes > size_ - used_)
+    return nullptr;
+
+  span = buffer_ + used_ + skip;
+  used_ += skip + bytes;
+  return span;
+}
+
+void OABufferPages::Release(void *span, size_t bytes, size_t)
+{
+  FreeSpan entry;
+
+  std::lock_guard<std::mutex> guard(lock_);
+  entry.Next = free_;
+  entry.Bytes = bytes;
+  std::memcpy(span, &entry, sizeof(entry));
+  free_ = static_cast<char *>(span);
+}
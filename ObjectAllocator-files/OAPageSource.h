@@ -0,0 +1,144 @@
+//---------------------------------------------------------------------------
+#ifndef OAPAGESOURCEH
+#define OAPAGESOURCEH
+//---------------------------------------------------------------------------
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Where an ObjectAllocator gets the memory for its pages (OAConfig::
+// PageSource_). One source may serve several allocators on several
+// threads, so the built-in sources lock whatever state they keep. A
+// source must outlive every allocator that uses it.
+class OAPageSource
+{
+public:
+  virtual ~OAPageSource() {}
+
+  // At least bytes of read/write memory aligned to alignment (a power of
+  // two), or null when the source is exhausted
+  virtual void *Acquire(size_t bytes, size_t alignment) = 0;
+
+  // Gives back a span from Acquire; bytes and alignment as passed to it
+  virtual void Release(void *span, size_t bytes, size_t alignment) = 0;
+};
+
+// new[], the default. Alignments past max_align_t are padded by hand.
+class OAHeapPages : public OAPageSource
+{
+public:
+  void *Acquire(size_t bytes, size_t alignment);
+  void Release(void *span, size_t bytes, size_t alignment);
+};
+
+// The process-wide OAPageCache (what UsePageCache_ picks); alignment up to
+// max_align_t
+class OACachedPages : public OAPageSource
+{
+public:
+  void *Acquire(size_t bytes, size_t alignment);
+  void Release(void *span, size_t bytes, size_t alignment);
+};
+
+// One anonymous OS mapping per span (whole OS pages). Freed pages really
+// go back to the OS instead of staying in the heap.
+class OAMmapPages : public OAPageSource
+{
+public:
+  void *Acquire(size_t bytes, size_t alignment);
+  void Release(void *span, size_t bytes, size_t alignment);
+};
+
+// Huge (large) pages, for big pages where TLB misses matter. Spans are
+// rounded up to the huge page size. Linux needs pages reserved in
+// /proc/sys/vm/nr_hugepages, Windows the "lock pages in memory" privilege;
+// without them a span is mapped with normal pages (on Linux with a
+// transparent huge page hint), or the request fails if Fallback is false.
+class OAHugePages : public OAPageSource
+{
+public:
+  explicit OAHugePages(bool Fallback = true);
+
+  size_t HugePageSize(void) const { return huge_; }
+
+  void *Acquire(size_t bytes, size_t alignment);
+  void Release(void *span, size_t bytes, size_t alignment);
+
+private:
+  size_t huge_;
+  bool fallback_;
+};
+
+// Spans of a file mapped shared, so pages can outlive the process or be
+// inspected from outside. Released spans are unmapped and their range of
+// the file reused. The file grows as needed up to Capacity (0 = no limit).
+class OAFilePages : public OAPageSource
+{
+public:
+  explicit OAFilePages(const char *Path, unsigned long long Capacity = 0);
+  ~OAFilePages();
+
+  bool IsOpen(void) const;  // false if the file couldn't be opened
+
+  void *Acquire(size_t bytes, size_t alignment);
+  void Release(void *span, size_t bytes, size_t alignment);
+
+protected:
+  explicit OAFilePages(unsigned long long Capacity);
+  void *map_span(unsigned long long offset, size_t size, size_t alignment);
+
+  std::intptr_t file_;      // descriptor (POSIX) or HANDLE (Windows), -1 = none
+  std::intptr_t section_;   // Windows: mapping of the whole object (0 = per span)
+  bool grows_;              // extend the file as spans are added
+
+private:
+  OAFilePages(const OAFilePages &);
+  OAFilePages &operator=(const OAFilePages &);
+
+  std::mutex lock_;
+  unsigned long long capacity_;
+  unsigned long long end_;  // bytes of the file handed out so far
+  std::vector<std::pair<unsigned long long, size_t> > free_; // (offset, size)
+  std::unordered_map<void *, unsigned long long> offsets_;   // live span -> offset
+};
+
+// Spans of a named shared memory object of Capacity bytes (shm_open, or a
+// named section on Windows) that other processes can map by name. The
+// name is removed when the source is destroyed (POSIX).
+class OASharedPages : public OAFilePages
+{
+public:
+  OASharedPages(const char *Name, unsigned long long Capacity);
+  ~OASharedPages();
+
+private:
+  char name_[256];
+};
+
+// Spans carved from a caller's buffer (not owned). Released spans are
+// reused for later requests of the same size; the buffer never shrinks.
+// They are linked through their own first bytes (a span is never carved
+// smaller than the link), so the source never touches the heap.
+class OABufferPages : public OAPageSource
+{
+public:
+  OABufferPages(void *Buffer, size_t Bytes);
+
+  size_t Used(void) const;  // bytes carved so far
+
+  void *Acquire(size_t bytes, size_t alignment);
+  void Release(void *span, size_t bytes, size_t alignment);
+
+private:
+  mutable std::mutex lock_;
+  char *buffer_;
+  size_t size_;
+  size_t used_;
+  char *free_;              // last released span, linked to the ones before
+};
+
+#endif
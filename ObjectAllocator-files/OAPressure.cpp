@@ -0,0 +1,118 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include "OAPressure.h"
+
+namespace OAPressure
+{
+
+#if defined(__linux__)
+
+// Whole contents of a small text file (empty if it can't be read)
+static std::string read_file(const std::string &path)
+{
+  std::string text;
+  std::FILE *file = std::fopen(path.c_str(), "r");
+  char buffer[256];
+  size_t count;
+
+  if (!file)
+    return text;
+  while ((count = std::fread(buffer, 1, sizeof(buffer), file)) > 0)
+    text.append(buffer, count);
+  std::fclose(file);
+  return text;
+}
+
+// Mount point of the cgroup v2 hierarchy and the process's node in it
+// ("/" for the root). Hybrid hosts mount it at /sys/fs/cgroup/unified.
+static bool cgroup_node(std::string &root, std::string &path)
+{
+  static const char *mounts[] = { "/sys/fs/cgroup", "/sys/fs/cgroup/unified" };
+  std::string groups = read_file("/proc/self/cgroup");
+  size_t line = groups.find("0::");
+
+  // The v2 entry is "0::/path"; it need not be the first line
+  while (line != std::string::npos && line && groups[line - 1] != '\n')
+    line = groups.find("0::", line + 1);
+  if (line == std::string::npos)
+    return false;
+  path = groups.substr(line + 3, groups.find('\n', line) - line - 3);
+
+  for (size_t i = 0; i < sizeof(mounts) / sizeof(*mounts); ++i)
+  {
+    if (!read_file(std::string(mounts[i]) + "/cgroup.controllers").empty())
+    {
+      root = mounts[i];
+      return true;
+    }
+  }
+  return false;
+}
+
+// Bytes a cgroup can still grow by
+static unsigned long long room(unsigned long long limit, unsigned long long usage)
+{
+  return usage < limit ? limit - usage : 0;
+}
+
+bool Read(Sample &sample)
+{
+  std::string root;
+  std::string path;
+  std::string pressure;
+  const char *some;
+
+  sample.Limit = 0;
+  sample.Usage = 0;
+  sample.SomeAvg10 = -1.0;
+
+  if (cgroup_node(root, path))
+  {
+    // Walk all the way up: any level may have less room left than the ones
+    // below it, whatever its limit ("max" means none at that level; the
+    // root has no memory.max at all). Keep the level with the least room.
+    for (std::string node = path; node.size() > 1; node.erase(node.rfind('/')))
+    {
+      std::string max = read_file(root + node + "/memory.max");
+      unsigned long long limit;
+      unsigned long long usage;
+
+      if (max.empty() || !max.compare(0, 3, "max"))
+        continue;
+
+      limit = std::strtoull(max.c_str(), nullptr, 10);
+      usage = std::strtoull(read_file(root + node + "/memory.current").c_str(), nullptr, 10);
+      if (!sample.Limit || room(limit, usage) < room(sample.Limit, sample.Usage))
+      {
+        sample.Limit = limit;
+        sample.Usage = usage;
+      }
+    }
+    pressure = read_file(root + path + "/memory.pressure");
+  }
+
+  // "some avg10=1.23 avg60=... total=..."
+  if (pressure.empty())
+    pressure = read_file("/proc/pressure/memory");
+  some = std::strstr(pressure.c_str(), "some avg10=");
+  if (some)
+    sample.SomeAvg10 = std::strtod(some + 11, nullptr);
+
+  return sample.Limit || sample.SomeAvg10 >= 0.0;
+}
+
+#else
+
+bool Read(Sample &sample)
+{
+  sample.Limit = 0;
+  sample.Usage = 0;
+  sample.SomeAvg10 = -1.0;
+  return false;
+}
+
+#endif
+
+}
@@ -0,0 +1,24 @@
+//---------------------------------------------------------------------------
+#ifndef OAPRESSUREH
+#define OAPRESSUREH
+//---------------------------------------------------------------------------
+
+// Reads the memory limit and pressure of the process's cgroup (cgroup v2
+// memory.max/memory.current and PSI). Linux only; elsewhere Read fails.
+namespace OAPressure
+{
+  struct Sample
+  {
+    unsigned long long Limit;   // memory.max in bytes (0 = no limit found)
+    unsigned long long Usage;   // memory.current of the same cgroup
+    double SomeAvg10;           // PSI "some" avg10 in percent (< 0 = unavailable)
+  };
+
+  // memory.max and memory.current of the cgroup with the least room left
+  // (limit - usage) on the path from the process's cgroup to the root, and
+  // the process cgroup's memory.pressure (or /proc/pressure/memory).
+  // Returns false if neither a limit nor PSI could be read.
+  bool Read(Sample &sample);
+}
+
+#endif
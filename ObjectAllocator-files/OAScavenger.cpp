@@ -0,0 +1,40 @@
+#include <chrono>
+#include "OAScavenger.h"
+#include "ObjectAllocator.h"
+
+OAScavenger::OAScavenger(ObjectAllocator &Owner, unsigned IntervalMs)
+  : Owner_(Owner), IntervalMs_(IntervalMs), Stop_(false)
+{
+}
+
+void OAScavenger::Start(void)
+{
+  Thread_ = std::thread(&OAScavenger::run, this);
+}
+
+OAScavenger::~OAScavenger()
+{
+  {
+    std::lock_guard<std::mutex> guard(StopLock_);
+    Stop_ = true;
+  }
+  StopSignal_.notify_one();
+  if (Thread_.joinable())
+    Thread_.join();
+}
+
+void OAScavenger::run(void)
+{
+  std::unique_lock<std::mutex> guard(StopLock_);
+
+  while (!Stop_)
+  {
+    // A pass runs each time the interval passes without a stop request
+    if (StopSignal_.wait_for(guard, std::chrono::milliseconds(IntervalMs_), [this] { return Stop_; }))
+      break;
+
+    guard.unlock();
+    Owner_.Scavenge();
+    guard.lock();
+  }
+}
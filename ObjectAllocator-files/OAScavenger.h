@@ -0,0 +1,42 @@
+//---------------------------------------------------------------------------
+#ifndef OASCAVENGERH
+#define OASCAVENGERH
+//---------------------------------------------------------------------------
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+class ObjectAllocator;
+
+// Background thread that calls ObjectAllocator::Scavenge every IntervalMs
+// milliseconds. Scavenge takes the allocator's lock, which every public
+// ObjectAllocator call holds while a scavenger exists.
+class OAScavenger
+{
+public:
+  OAScavenger(ObjectAllocator &Owner, unsigned IntervalMs);
+
+  // Starts the thread; the owner calls it once it can take Scavenge calls
+  void Start(void);
+
+  // Stops and joins the thread (a pass in progress finishes first)
+  ~OAScavenger();
+
+private:
+  // Make private to prevent copy construction and assignment
+  OAScavenger(const OAScavenger &);
+  OAScavenger &operator=(const OAScavenger &);
+
+  void run(void);
+
+  ObjectAllocator &Owner_;
+  unsigned IntervalMs_;
+
+  std::mutex StopLock_;
+  std::condition_variable StopSignal_;
+  bool Stop_;
+  std::thread Thread_;
+};
+
+#endif
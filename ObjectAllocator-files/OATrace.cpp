@@ -0,0 +1,562 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <new>
+#include "OATrace.h"
+
+namespace
+{
+  const char TRACE_MAGIC[8] = { 'O', 'A', 'T', 'R', 'A', 'C', 'E', '1' };
+
+  std::atomic<unsigned> NextRecorderId(1);
+
+  // Last ring this thread used, and the recorder it belongs to
+  struct RingCache
+  {
+    unsigned Owner;
+    void *Ring;
+  };
+
+  thread_local RingCache ThreadRing = { 0, nullptr };
+
+  void put_varint(std::vector<unsigned char> &out, unsigned long long value)
+  {
+    while (value >= 0x80)
+    {
+      out.push_back(static_cast<unsigned char>(value | 0x80));
+      value >>= 7;
+    }
+    out.push_back(static_cast<unsigned char>(value));
+  }
+
+  unsigned long long zigzag(unsigned long long from, unsigned long long to)
+  {
+    long long delta = static_cast<long long>(to - from);
+    return (static_cast<unsigned long long>(delta) << 1) ^ static_cast<unsigned long long>(delta >> 63);
+  }
+
+  unsigned long long unzigzag(unsigned long long from, unsigned long long value)
+  {
+    unsigned long long delta = (value >> 1) ^ (0 - (value & 1));
+    return from + delta;
+  }
+
+  // Bounds-checked cursor over the raw file contents
+  struct TraceInput
+  {
+    const std::vector<unsigned char> &Data;
+    size_t Pos;
+    bool Bad;
+
+    explicit TraceInput(const std::vector<unsigned char> &data) : Data(data), Pos(0), Bad(false) {}
+
+    bool AtEnd(void) const { return Pos >= Data.size(); }
+
+    unsigned char Byte(void)
+    {
+      if (AtEnd())
+      {
+        Bad = true;
+        return 0;
+      }
+      return Data[Pos++];
+    }
+
+    unsigned long long Varint(void)
+    {
+      unsigned long long value = 0;
+      unsigned shift = 0;
+      unsigned char byte;
+
+      do
+      {
+        byte = Byte();
+        if (shift < 64)
+          value |= static_cast<unsigned long long>(byte & 0x7F) << shift;
+        shift += 7;
+      } while ((byte & 0x80) && !Bad);
+
+      return value;
+    }
+
+    unsigned Small(void)
+    {
+      return static_cast<unsigned>(Varint());
+    }
+  };
+
+  bool earlier(const OATraceEvent &left, const OATraceEvent &right)
+  {
+    return left.Time < right.Time;
+  }
+}
+
+OATraceRecorder::OATraceRecorder(const char *Path, unsigned RingEvents, unsigned FlushMs)
+  : File_(std::fopen(Path, "wb")),
+  Mask_(1),
+  FlushMs_(FlushMs ? FlushMs : 1),
+  Id_(NextRecorderId.fetch_add(1)),
+  Dropped_(0),
+  DroppedWritten_(0),
+  Pools_(0),
+  Stop_(false)
+{
+  // Round the ring up to a power of two
+  while (Mask_ < RingEvents)
+  {
+    Mask_ <<= 1;
+  }
+  --Mask_;
+
+  if (!File_)
+  {
+    return;
+  }
+
+  double rate = OAClock::TicksPerSecond();
+  unsigned char raw[sizeof(double)];
+  std::memcpy(raw, &rate, sizeof(double));
+
+  Buffer_.insert(Buffer_.end(), TRACE_MAGIC, TRACE_MAGIC + sizeof(TRACE_MAGIC));
+  Buffer_.push_back('H');
+  Buffer_.insert(Buffer_.end(), raw, raw + sizeof(double));
+
+  Writer_ = std::thread(&OATraceRecorder::writer_loop, this);
+}
+
+OATraceRecorder::~OATraceRecorder()
+{
+  if (File_)
+  {
+    {
+      std::lock_guard<std::mutex> lock(StopLock_);
+      Stop_ = true;
+    }
+    StopSignal_.notify_one();
+    Writer_.join();
+
+    Buffer_.push_back('Z');
+    std::fwrite(Buffer_.data(), 1, Buffer_.size(), File_);
+    std::fclose(File_);
+  }
+
+  for (size_t i = 0; i < Rings_.size(); ++i)
+  {
+    delete[] Rings_[i]->Events;
+    delete Rings_[i];
+  }
+}
+
+bool OATraceRecorder::IsOpen() const
+{
+  return File_ != nullptr;
+}
+
+unsigned long long OATraceRecorder::Dropped() const
+{
+  return Dropped_.load(std::memory_order_relaxed);
+}
+
+unsigned OATraceRecorder::Attach(size_t ObjectSize, const OAConfig& config)
+{
+  std::lock_guard<std::mutex> lock(LabelLock_);
+  unsigned pool = Pools_++;
+
+  PendingPools_.push_back('P');
+  put_varint(PendingPools_, pool);
+  put_varint(PendingPools_, ObjectSize);
+  put_varint(PendingPools_, config.ObjectsPerPage_);
+  put_varint(PendingPools_, config.MaxPages_);
+  put_varint(PendingPools_, static_cast<unsigned long long>(config.HBlockInfo_.type_));
+  put_varint(PendingPools_, config.HBlockInfo_.size_);
+  put_varint(PendingPools_, config.PadBytes_);
+
+  return pool;
+}
+
+void OATraceRecorder::Flush()
+{
+  if (!File_)
+  {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(WriteLock_);
+  drain();
+  std::fwrite(Buffer_.data(), 1, Buffer_.size(), File_);
+  std::fflush(File_);
+  Buffer_.clear();
+}
+
+OATraceRecorder::Ring* OATraceRecorder::thread_ring()
+{
+  if (ThreadRing.Owner == Id_)
+  {
+    return static_cast<Ring*>(ThreadRing.Ring);
+  }
+
+  Ring* ring = register_thread();
+  if (!ring)
+  {
+    return nullptr;
+  }
+  ThreadRing.Owner = Id_;
+  ThreadRing.Ring = ring;
+  return ring;
+}
+
+// Finds or creates the calling thread's ring (slow path, once per thread).
+// Null if the heap is out: the event is dropped, and recording never throws
+// out of an allocator call.
+OATraceRecorder::Ring* OATraceRecorder::register_thread()
+{
+  std::lock_guard<std::mutex> lock(RingLock_);
+
+  std::map<std::thread::id, Ring*>::iterator found = Threads_.find(std::this_thread::get_id());
+  if (found != Threads_.end())
+  {
+    return found->second;
+  }
+
+  Ring* ring = new (std::nothrow) Ring;
+  if (!ring)
+  {
+    return nullptr;
+  }
+  ring->Events = new (std::nothrow) RawEvent[Mask_ + 1];
+  if (!ring->Events)
+  {
+    delete ring;
+    return nullptr;
+  }
+  ring->Head.store(0);
+  ring->Tail.store(0);
+  ring->Thread = static_cast<unsigned>(Rings_.size());
+  ring->LastTime = 0;
+  ring->LastSlot = 0;
+  for (unsigned i = 0; i < Ring::LABEL_CACHE; ++i)
+  {
+    ring->CachedLabel[i] = nullptr;
+    ring->CachedId[i] = 0;
+  }
+
+#if OA_EXCEPTIONS
+  try
+  {
+#endif
+    Rings_.push_back(ring);
+    Threads_[std::this_thread::get_id()] = ring;
+#if OA_EXCEPTIONS
+  }
+  catch (const std::bad_alloc&)
+  {
+    if (!Rings_.empty() && Rings_.back() == ring)
+    {
+      Rings_.pop_back();
+    }
+    delete[] ring->Events;
+    delete ring;
+    return nullptr;
+  }
+#endif
+  return ring;
+}
+
+// Labels are cached per thread by their text, not their address, so a
+// reused or rewritten label buffer can't pick up a stale id. Only a miss
+// takes the label lock.
+unsigned OATraceRecorder::label_id(Ring* ring, const char* label)
+{
+  unsigned hash = 2166136261u;   // FNV-1a
+
+  for (const char* c = label; *c; ++c)
+  {
+    hash = (hash ^ static_cast<unsigned char>(*c)) * 16777619u;
+  }
+
+  unsigned slot = hash & (Ring::LABEL_CACHE - 1);
+  if (!ring->CachedLabel[slot] || std::strcmp(ring->CachedLabel[slot], label))
+  {
+    const char* interned;
+    unsigned id;
+
+    // Not cached when interning fails: the event goes out unlabelled
+    id = intern_label(label, interned);
+    if (!id)
+    {
+      return 0;
+    }
+    ring->CachedLabel[slot] = interned;
+    ring->CachedId[slot] = id;
+  }
+
+  return ring->CachedId[slot];
+}
+
+// Id of label; interned points at the recorder's own copy of the text.
+// 0 (no label) if the heap is out.
+unsigned OATraceRecorder::intern_label(const char* label, const char*& interned)
+{
+  std::lock_guard<std::mutex> lock(LabelLock_);
+
+  std::map<std::string, unsigned>::iterator found = Labels_.find(label);
+  if (found == Labels_.end())
+  {
+    unsigned id = static_cast<unsigned>(Labels_.size()) + 1;
+
+#if OA_EXCEPTIONS
+    try
+    {
+#endif
+      PendingLabels_.push_back(label);
+      found = Labels_.insert(std::make_pair(std::string(label), id)).first;
+#if OA_EXCEPTIONS
+    }
+    catch (const std::bad_alloc&)
+    {
+      if (!PendingLabels_.empty() && PendingLabels_.back() == label)
+      {
+        PendingLabels_.pop_back();
+      }
+      return 0;
+    }
+#endif
+  }
+
+  interned = found->first.c_str();
+  return found->second;
+}
+
+void OATraceRecorder::writer_loop()
+{
+  std::unique_lock<std::mutex> stoplock(StopLock_);
+
+  while (!Stop_)
+  {
+    StopSignal_.wait_for(stoplock, std::chrono::milliseconds(FlushMs_));
+    stoplock.unlock();
+
+    {
+      std::lock_guard<std::mutex> lock(WriteLock_);
+      drain();
+      std::fwrite(Buffer_.data(), 1, Buffer_.size(), File_);
+      Buffer_.clear();
+    }
+
+    stoplock.lock();
+  }
+
+  // Final pass for anything recorded while we were writing
+  std::lock_guard<std::mutex> lock(WriteLock_);
+  drain();
+}
+
+// Encodes pending pools, labels and ring contents into Buffer_
+void OATraceRecorder::drain()
+{
+  std::vector<Ring*> rings;
+  std::vector<unsigned> heads;
+
+  {
+    std::lock_guard<std::mutex> lock(RingLock_);
+    rings = Rings_;
+  }
+
+  // Snapshot the heads first: any label or pool an event refers to was
+  // registered before that event was published, so it is pending by now
+  for (size_t i = 0; i < rings.size(); ++i)
+  {
+    heads.push_back(rings[i]->Head.load(std::memory_order_acquire));
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(LabelLock_);
+
+    Buffer_.insert(Buffer_.end(), PendingPools_.begin(), PendingPools_.end());
+    PendingPools_.clear();
+
+    for (size_t i = 0; i < PendingLabels_.size(); ++i)
+    {
+      Buffer_.push_back('L');
+      put_varint(Buffer_, PendingLabels_[i].size());
+      Buffer_.insert(Buffer_.end(), PendingLabels_[i].begin(), PendingLabels_[i].end());
+    }
+    PendingLabels_.clear();
+  }
+
+  for (size_t i = 0; i < rings.size(); ++i)
+  {
+    Ring* ring = rings[i];
+    unsigned tail = ring->Tail.load(std::memory_order_relaxed);
+    unsigned count = heads[i] - tail;
+
+    if (!count)
+    {
+      continue;
+    }
+
+    Buffer_.push_back('E');
+    put_varint(Buffer_, ring->Thread);
+    put_varint(Buffer_, count);
+
+    for (; tail != heads[i]; ++tail)
+    {
+      const RawEvent& event = ring->Events[tail & Mask_];
+
+      // The very first delta of a thread is its absolute timestamp
+      put_varint(Buffer_, event.Time - ring->LastTime);
+      Buffer_.push_back(event.Op);
+      put_varint(Buffer_, event.Pool);
+      put_varint(Buffer_, zigzag(ring->LastSlot, event.Slot));
+      put_varint(Buffer_, event.Label);
+
+      ring->LastTime = event.Time;
+      ring->LastSlot = event.Slot;
+    }
+
+    ring->Tail.store(tail, std::memory_order_release);
+  }
+
+  unsigned long long dropped = Dropped_.load(std::memory_order_relaxed);
+  if (dropped != DroppedWritten_)
+  {
+    Buffer_.push_back('D');
+    put_varint(Buffer_, dropped);
+    DroppedWritten_ = dropped;
+  }
+}
+
+OATraceReader::OATraceReader()
+  : TicksPerSecond_(0.0), Dropped_(0), Complete_(false)
+{
+}
+
+bool OATraceReader::Load(const char* Path)
+{
+  Events_.clear();
+  Pools_.clear();
+  Labels_.clear();
+  TicksPerSecond_ = 0.0;
+  Dropped_ = 0;
+  Complete_ = false;
+  Error_.clear();
+
+  std::FILE* file = std::fopen(Path, "rb");
+  if (!file)
+  {
+    Error_ = std::string("cannot open ") + Path;
+    return false;
+  }
+
+  std::vector<unsigned char> data;
+  unsigned char chunk[65536];
+  size_t got;
+  while ((got = std::fread(chunk, 1, sizeof(chunk), file)) > 0)
+  {
+    data.insert(data.end(), chunk, chunk + got);
+  }
+  std::fclose(file);
+
+  if (data.size() < sizeof(TRACE_MAGIC) || std::memcmp(data.data(), TRACE_MAGIC, sizeof(TRACE_MAGIC)))
+  {
+    Error_ = "not an allocation trace";
+    return false;
+  }
+
+  // Per-thread delta state, indexed by thread id
+  std::vector<unsigned long long> lasttime;
+  std::vector<unsigned long long> lastslot;
+
+  TraceInput in(data);
+  in.Pos = sizeof(TRACE_MAGIC);
+
+  while (!in.AtEnd() && !in.Bad && !Complete_)
+  {
+    unsigned char record = in.Byte();
+
+    if (record == 'H')
+    {
+      if (in.Pos + sizeof(double) > data.size())
+      {
+        in.Bad = true;
+        break;
+      }
+      std::memcpy(&TicksPerSecond_, &data[in.Pos], sizeof(double));
+      in.Pos += sizeof(double);
+    }
+    else if (record == 'P')
+    {
+      OATracePool pool;
+
+      in.Small();  // pool ids are assigned in order
+      pool.ObjectSize_ = static_cast<size_t>(in.Varint());
+      pool.ObjectsPerPage_ = in.Small();
+      pool.MaxPages_ = in.Small();
+      pool.HBlockType_ = static_cast<OAConfig::HBLOCK_TYPE>(in.Small());
+      pool.HBlockSize_ = static_cast<size_t>(in.Varint());
+      pool.PadBytes_ = in.Small();
+      Pools_.push_back(pool);
+    }
+    else if (record == 'L')
+    {
+      size_t length = static_cast<size_t>(in.Varint());
+      if (in.Bad || length > data.size() - in.Pos)
+      {
+        in.Bad = true;
+        break;
+      }
+      Labels_.push_back(std::string(data.begin() + static_cast<std::ptrdiff_t>(in.Pos),
+        data.begin() + static_cast<std::ptrdiff_t>(in.Pos + length)));
+      in.Pos += length;
+    }
+    else if (record == 'E')
+    {
+      unsigned thread = in.Small();
+      unsigned long long count = in.Varint();
+
+      if (thread >= lasttime.size())
+      {
+        lasttime.resize(thread + 1, 0);
+        lastslot.resize(thread + 1, 0);
+      }
+
+      for (unsigned long long i = 0; i < count && !in.Bad; ++i)
+      {
+        OATraceEvent event;
+
+        event.Time = lasttime[thread] + in.Varint();
+        event.Op = in.Byte();
+        event.Pool = in.Small();
+        event.Slot = unzigzag(lastslot[thread], in.Varint());
+        event.Label = in.Small();
+        event.Thread = thread;
+
+        lasttime[thread] = event.Time;
+        lastslot[thread] = event.Slot;
+        Events_.push_back(event);
+      }
+    }
+    else if (record == 'D')
+    {
+      Dropped_ = in.Varint();
+    }
+    else if (record == 'Z')
+    {
+      Complete_ = true;
+    }
+    else
+    {
+      in.Bad = true;
+    }
+  }
+
+  if (in.Bad)
+  {
+    Error_ = "truncated or corrupt trace";
+    return false;
+  }
+
+  // Chunks from different threads interleave; restore global order
+  std::stable_sort(Events_.begin(), Events_.end(), earlier);
+  return true;
+}
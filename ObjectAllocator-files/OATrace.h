@@ -0,0 +1,199 @@
+//---------------------------------------------------------------------------
+#ifndef OATRACEH
+#define OATRACEH
+//---------------------------------------------------------------------------
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ObjectAllocator.h"
+
+// Binary allocation trace
+//
+// File layout: the 8-byte magic "OATRACE1" followed by records. Every
+// integer is an unsigned LEB128 varint; signed deltas are zigzag encoded.
+//
+//   'H' ticks-per-second(double, 8 raw bytes)    once, right after the magic
+//   'P' pool objsize objsperpage maxpages hbtype hbsize pad
+//   'L' label length bytes                       label ids start at 1
+//   'E' thread count { dtime op pool dslot label } * count
+//   'D' dropped                                  running total of lost events
+//   'Z'                                          end of trace
+//
+// In an 'E' chunk, dtime is the tick delta from the previous event of the
+// same thread (a thread's first event carries its absolute tick count) and
+// dslot the zigzag delta from that thread's previous slot id. A slot id is
+// the block address (the page address for page events); it only serves to
+// pair each free with the allocation it undoes.
+class OATraceRecorder
+{
+public:
+  enum TRACE_OP { opAllocate, opFree, opNewPage };
+
+  // Opens Path and starts the writer thread. Each recording thread gets a
+  // ring of RingEvents entries; events are dropped (and counted) when a ring
+  // is full. The writer drains every FlushMs milliseconds.
+  OATraceRecorder(const char *Path, unsigned RingEvents = 8192, unsigned FlushMs = 20);
+
+  // Stops the writer, drains all rings and closes the file
+  ~OATraceRecorder();
+
+  bool IsOpen(void) const;                    // false if Path could not be opened
+  unsigned long long Dropped(void) const;     // events lost to full rings
+
+  // Registers an allocator and returns the pool id stamped on its events
+  unsigned Attach(size_t ObjectSize, const OAConfig &config);
+
+  // Appends an event to the calling thread's ring. Never waits for the
+  // writer; the only lock is the label lock, taken the first time a thread
+  // records a label text it hasn't cached yet.
+  void Record(unsigned Pool, TRACE_OP Op, const void *Slot, const char *Label)
+  {
+    Ring *ring = thread_ring();
+
+    // No ring (out of memory), or full: the writer hasn't caught up
+    if (!ring)
+    {
+      Dropped_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    unsigned head = ring->Head.load(std::memory_order_relaxed);
+    if (head - ring->Tail.load(std::memory_order_acquire) > Mask_)
+    {
+      Dropped_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+
+    RawEvent &event = ring->Events[head & Mask_];
+    event.Time = OAClock::Ticks();
+    event.Slot = reinterpret_cast<std::uintptr_t>(Slot);
+    event.Label = Label ? label_id(ring, Label) : 0;
+    event.Pool = Pool;
+    event.Op = static_cast<unsigned char>(Op);
+
+    ring->Head.store(head + 1, std::memory_order_release);
+  }
+
+  // Writes out everything recorded so far
+  void Flush(void);
+
+private:
+  struct RawEvent
+  {
+    unsigned long long Time;
+    unsigned long long Slot;
+    unsigned Label;
+    unsigned Pool;
+    unsigned char Op;
+  };
+
+  // Single-producer (owning thread) single-consumer (writer) ring
+  struct Ring
+  {
+    static const unsigned LABEL_CACHE = 64;
+
+    std::atomic<unsigned> Head;       // next slot the producer writes
+    std::atomic<unsigned> Tail;       // next slot the writer reads
+    RawEvent *Events;
+    unsigned Thread;                  // dense thread id
+    unsigned long long LastTime;      // writer-side delta state
+    unsigned long long LastSlot;
+    const char *CachedLabel[LABEL_CACHE]; // producer-side label id cache, keyed by
+                                          // text (points at the interned copy)
+    unsigned CachedId[LABEL_CACHE];
+  };
+
+  // Make private to prevent copy construction and assignment
+  OATraceRecorder(const OATraceRecorder &);
+  OATraceRecorder &operator=(const OATraceRecorder &);
+
+  Ring *thread_ring(void);
+  Ring *register_thread(void);
+  unsigned label_id(Ring *ring, const char *label);
+  unsigned intern_label(const char *label, const char *&interned);
+  void writer_loop(void);
+  void drain(void);   // caller holds WriteLock_
+
+  std::FILE *File_;
+  unsigned Mask_;                      // ring capacity - 1
+  unsigned FlushMs_;
+  unsigned Id_;                        // distinguishes recorders in thread caches
+  std::atomic<unsigned long long> Dropped_;
+  unsigned long long DroppedWritten_;
+
+  std::mutex RingLock_;                // guards Rings_ and Threads_
+  std::vector<Ring *> Rings_;
+  std::map<std::thread::id, Ring *> Threads_;
+
+  std::mutex LabelLock_;               // guards labels and pools
+  std::map<std::string, unsigned> Labels_;
+  std::vector<std::string> PendingLabels_;
+  std::vector<unsigned char> PendingPools_;  // encoded 'P' records
+  unsigned Pools_;
+
+  std::mutex WriteLock_;               // one drain at a time
+  std::vector<unsigned char> Buffer_;
+
+  std::mutex StopLock_;
+  std::condition_variable StopSignal_;
+  bool Stop_;
+  std::thread Writer_;
+};
+
+// One decoded trace event
+struct OATraceEvent
+{
+  unsigned long long Time;   // absolute ticks
+  unsigned long long Slot;   // block (or page) address in the recording process
+  unsigned Label;            // 0 = no label, else index + 1 into Labels()
+  unsigned Pool;
+  unsigned Thread;
+  unsigned char Op;          // OATraceRecorder::TRACE_OP
+};
+
+// An allocator that was attached to the recorder
+struct OATracePool
+{
+  size_t ObjectSize_;
+  unsigned ObjectsPerPage_;
+  unsigned MaxPages_;
+  OAConfig::HBLOCK_TYPE HBlockType_;
+  size_t HBlockSize_;
+  unsigned PadBytes_;
+};
+
+// Loads a trace written by OATraceRecorder
+class OATraceReader
+{
+public:
+  OATraceReader(void);
+
+  // Decodes the whole file; events from all threads are merged by time.
+  // Returns false (see Error) if the file is missing or malformed.
+  bool Load(const char *Path);
+
+  const std::vector<OATraceEvent> &Events(void) const { return Events_; }
+  const std::vector<OATracePool> &Pools(void) const { return Pools_; }
+  const std::vector<std::string> &Labels(void) const { return Labels_; }
+  double TicksPerSecond(void) const { return TicksPerSecond_; }
+  unsigned long long Dropped(void) const { return Dropped_; }
+  bool Complete(void) const { return Complete_; }   // saw the end record
+  const std::string &Error(void) const { return Error_; }
+
+private:
+  std::vector<OATraceEvent> Events_;
+  std::vector<OATracePool> Pools_;
+  std::vector<std::string> Labels_;
+  double TicksPerSecond_;
+  unsigned long long Dropped_;
+  bool Complete_;
+  std::string Error_;
+};
+
+#endif
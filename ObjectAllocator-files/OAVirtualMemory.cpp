@@ -0,0 +1,128 @@
+#include <cstdint>
+#include "OAVirtualMemory.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace OAVirtualMemory
+{
+
+static size_t query_page_size(void)
+{
+#if defined(_WIN32)
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwPageSize;
+#else
+  long size = sysconf(_SC_PAGESIZE);
+  return size > 0 ? static_cast<size_t>(size) : 4096;
+#endif
+}
+
+size_t PageSize(void)
+{
+  static const size_t size = query_page_size();
+  return size;
+}
+
+void *Reserve(size_t bytes)
+{
+#if defined(_WIN32)
+  return VirtualAlloc(nullptr, bytes, MEM_RESERVE, PAGE_NOACCESS);
+#else
+  void *address = mmap(nullptr, bytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  return address == MAP_FAILED ? nullptr : address;
+#endif
+}
+
+bool Commit(void *address, size_t bytes)
+{
+  std::uintptr_t page = PageSize();
+  std::uintptr_t start = reinterpret_cast<std::uintptr_t>(address) & ~(page - 1);
+  std::uintptr_t end = (reinterpret_cast<std::uintptr_t>(address) + bytes + page - 1) & ~(page - 1);
+
+#if defined(_WIN32)
+  return VirtualAlloc(reinterpret_cast<void *>(start), end - start, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+#else
+  return mprotect(reinterpret_cast<void *>(start), end - start, PROT_READ | PROT_WRITE) == 0;
+#endif
+}
+
+void Decommit(void *address, size_t bytes)
+{
+  std::uintptr_t page = PageSize();
+  std::uintptr_t start = (reinterpret_cast<std::uintptr_t>(address) + page - 1) & ~(page - 1);
+  std::uintptr_t end = (reinterpret_cast<std::uintptr_t>(address) + bytes) & ~(page - 1);
+
+  // Only OS pages that lie entirely inside the range can go
+  if (end <= start)
+    return;
+
+#if defined(_WIN32)
+  VirtualFree(reinterpret_cast<void *>(start), end - start, MEM_DECOMMIT);
+#else
+  madvise(reinterpret_cast<void *>(start), end - start, MADV_DONTNEED);
+  mprotect(reinterpret_cast<void *>(start), end - start, PROT_NONE);
+#endif
+}
+
+size_t Discard(void *address, size_t bytes)
+{
+  std::uintptr_t page = PageSize();
+  std::uintptr_t start = (reinterpret_cast<std::uintptr_t>(address) + page - 1) & ~(page - 1);
+  std::uintptr_t end = (reinterpret_cast<std::uintptr_t>(address) + bytes) & ~(page - 1);
+
+  if (end <= start)
+    return 0;
+
+#if defined(_WIN32)
+  if (!VirtualAlloc(reinterpret_cast<void *>(start), end - start, MEM_RESET, PAGE_READWRITE))
+    return 0;
+#else
+  if (madvise(reinterpret_cast<void *>(start), end - start, MADV_DONTNEED))
+    return 0;
+#endif
+  return end - start;
+}
+
+void Release(void *address, size_t bytes)
+{
+#if defined(_WIN32)
+  (void)bytes;
+  VirtualFree(address, 0, MEM_RELEASE);
+#else
+  munmap(address, bytes);
+#endif
+}
+
+bool Lock(void *address, size_t bytes)
+{
+  std::uintptr_t page = PageSize();
+  std::uintptr_t start = reinterpret_cast<std::uintptr_t>(address) & ~(page - 1);
+  std::uintptr_t end = (reinterpret_cast<std::uintptr_t>(address) + bytes + page - 1) & ~(page - 1);
+
+#if defined(_WIN32)
+  return VirtualLock(reinterpret_cast<void *>(start), end - start) != 0;
+#else
+  return mlock(reinterpret_cast<void *>(start), end - start) == 0;
+#endif
+}
+
+void Unlock(void *address, size_t bytes)
+{
+  std::uintptr_t page = PageSize();
+  std::uintptr_t start = reinterpret_cast<std::uintptr_t>(address) & ~(page - 1);
+  std::uintptr_t end = (reinterpret_cast<std::uintptr_t>(address) + bytes + page - 1) & ~(page - 1);
+
+#if defined(_WIN32)
+  VirtualUnlock(reinterpret_cast<void *>(start), end - start);
+#else
+  munlock(reinterpret_cast<void *>(start), end - start);
+#endif
+}
+
+} // namespace OAVirtualMemory
@@ -0,0 +1,26 @@
+//---------------------------------------------------------------------------
+#ifndef OAVIRTUALMEMORYH
+#define OAVIRTUALMEMORYH
+//---------------------------------------------------------------------------
+
+#include <cstddef>
+
+// Thin portable layer over the OS virtual memory calls (mmap/mprotect/
+// madvise on POSIX, VirtualAlloc/VirtualFree on Windows). Addresses and
+// sizes passed to Commit/Decommit may be unaligned; they are widened (Commit)
+// or narrowed (Decommit) to whole OS pages.
+namespace OAVirtualMemory
+{
+  size_t PageSize(void);                    // OS page size in bytes
+
+  void *Reserve(size_t bytes);              // inaccessible range, null on failure
+  bool Commit(void *address, size_t bytes); // make readable/writable
+  void Decommit(void *address, size_t bytes); // drop backing memory, make inaccessible
+  size_t Discard(void *address, size_t bytes); // drop backing memory, stays accessible
+                                               // (reads zeros on POSIX); returns bytes dropped
+  void Release(void *address, size_t bytes);  // return a Reserve'd range
+  bool Lock(void *address, size_t bytes);     // keep resident (never paged out)
+  void Unlock(void *address, size_t bytes);
+}
+
+#endif
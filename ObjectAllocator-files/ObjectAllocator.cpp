@@ -1,13 +1,112 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <new>
 #include "ObjectAllocator.h"
+#include "OAPageSource.h"
+#include "OAPressure.h"
+#include "OAScavenger.h"
+#include "OATrace.h"
+#include "OAVirtualMemory.h"
+
+// Prefaulting touches one byte per this many (the smallest common OS page)
+static const size_t PREFAULT_STRIDE = 4096;
+
+// Offset of the 16-bit use counter in an extended header
+static const size_t EXTENDED_USE_COUNT = 1;
+
+// Bytes in front of a new/delete pass-through object
+static const size_t CPP_BLOCK_SIZE =
+  (sizeof(CPPBlock) + alignof(std::max_align_t) - 1) / alignof(std::max_align_t) * alignof(std::max_align_t);
+
+// Alignment of page memory, as new[] would give it
+static const size_t PAGE_ALIGNMENT = alignof(std::max_align_t);
+
+// How often CgroupAware_ rereads the cgroup files (and the scavenger
+// interval it gets when none was configured)
+static const unsigned PRESSURE_SAMPLE_MS = 100;
+
+namespace
+{
+  // Wake for AllocateWait: Context is the parked thread's condition variable
+  void wake_thread(OAWaiter* waiter)
+  {
+    static_cast<std::condition_variable*>(waiter->Context)->notify_one();
+  }
+
+  // Last failure on this thread, and the pool it came from. Kept per thread
+  // so a pool shared between threads never reports (or throws) an error
+  // another thread ran into after the lock was released.
+  struct LastFailure
+  {
+    const ObjectAllocator* Pool;
+    ObjectAllocator::OA_ERROR Error;
+    const char* Message;
+  };
+
+  thread_local LastFailure ThreadFailure = { nullptr, ObjectAllocator::oaOK, "" };
+
+  // The page sources used when OAConfig::PageSource_ is null. Never
+  // destroyed, so allocators that outlive static destruction still work.
+  OAPageSource* heap_pages()
+  {
+    static OAPageSource* pages = new OAHeapPages;
+    return pages;
+  }
+
+  OAPageSource* cached_pages()
+  {
+    static OAPageSource* pages = new OACachedPages;
+    return pages;
+  }
+
+  // Bumps an extended header's use counter. It wraps from 0xFFFF to 1, so
+  // a block that has been allocated never reads 0 (which means "free").
+  void bump_use_count(char* header)
+  {
+    unsigned short usecount;
+
+    std::memcpy(&usecount, header + EXTENDED_USE_COUNT, sizeof(usecount));
+    usecount = static_cast<unsigned short>(usecount == 0xFFFF ? 1 : usecount + 1);
+    std::memcpy(header + EXTENDED_USE_COUNT, &usecount, sizeof(usecount));
+  }
+
+  // Holds the allocator's lock for a public call (no-op without one)
+  class PoolLock
+  {
+  public:
+    explicit PoolLock(std::mutex* lock) : lock_(lock)
+    {
+      if (lock_)
+        lock_->lock();
+    }
+
+    ~PoolLock()
+    {
+      if (lock_)
+        lock_->unlock();
+    }
+
+  private:
+    std::mutex* lock_;
+  };
+}
 
 ObjectAllocator::ObjectAllocator(size_t ObjectSize, const OAConfig& config)
+  : ObjectAllocator(ObjectSize, config, nullptr, 0)
+{
+}
+
+ObjectAllocator::ObjectAllocator(size_t ObjectSize, const OAConfig& config, void* Buffer, size_t BufferSize)
   : PageList_(nullptr), FreeList_(nullptr), 
   ObjectSize_(ObjectSize),
-  PageSize_(config.ObjectsPerPage_ * ObjectSize + sizeof(void*)
-    + (config.ObjectsPerPage_ * 2 * config.PadBytes_)
-    + (config.ObjectsPerPage_ * config.HBlockInfo_.size_)
-  ),
+  PageSize_(0),
+  PageStride_(0),
   PadBytes_(config.PadBytes_),
   ObjectsPerPage_(config.ObjectsPerPage_),
   MaxPages_(config.MaxPages_),
@@ -15,230 +114,819 @@ ObjectAllocator::ObjectAllocator(size_t ObjectSize, const OAConfig& config)
   LeftAlignSize_(config.LeftAlignSize_),
   InterAlignSize_(config.InterAlignSize_),
   HBlockInfo_(config.HBlockInfo_),
-  UseCPPMemManager_(config.UseCPPMemManager_)
+  UseCPPMemManager_(config.UseCPPMemManager_ && !Buffer && !config.RealTime_),
+  CPPBlocks_(nullptr),
+  Latency_(config.LatencyStats_ ? new OALatencyStats : nullptr),
+  Trace_(config.RealTime_ || Buffer ? nullptr : config.TraceRecorder_),
+  TracePool_(Trace_ ? Trace_->Attach(ObjectSize, config) : 0),
+  BlockSize_(ObjectSize + 2 * config.PadBytes_ + config.HBlockInfo_.size_),
+  GrowthPolicy_(config.GrowthPolicy_),
+  MaxObjectsPerPage_(config.MaxObjectsPerPage_ > config.ObjectsPerPage_ ?
+    config.MaxObjectsPerPage_ : config.ObjectsPerPage_),
+  NextPageBlocks_(config.ObjectsPerPage_),
+  ReserveObjects_(config.ReserveObjects_),
+  PrefaultPages_(config.PrefaultPages_),
+  Region_(nullptr),
+  RegionSize_(0),
+  BufferRegion_(Buffer != nullptr),
+  FreeListType_(config.FreeListType_),
+  LinkBytes_(0),
+  NoSlot_(0),
+  Buckets_(1),
+  AllocPolicy_(config.AllocPolicy_),
+  EmptyPageBlocks_(0),
+  ScavengeIntervalMs_(UseCPPMemManager_ || config.RealTime_ ? 0 : config.ScavengeIntervalMs_),
+  ScavengeSparePages_(config.ScavengeSparePages_),
+  ScavengeDecayMs_(config.ScavengeDecayMs_),
+  CgroupAware_(config.CgroupAware_ && !UseCPPMemManager_ && !Buffer && !config.RealTime_),
+  CgroupHeadroomPct_(config.CgroupHeadroomPct_),
+  PressureAvg10_(config.PressureAvg10_),
+  PressureSampledAt_(0),
+  PressureSampled_(false),
+  MemoryTight_(false),
+  OverflowMode_(UseCPPMemManager_ || config.RealTime_ || Buffer ? OAConfig::ofNone : config.OverflowMode_),
+  OverflowPool_(config.OverflowPool_),
+  OverflowAllocations_(0),
+  UsePageCache_(config.UsePageCache_ && !Buffer),
+  PageSource_(config.PageSource_ ? config.PageSource_ : UsePageCache_ ? cached_pages() : heap_pages()),
+  RealTime_(config.RealTime_),
+  Lock_(nullptr),
+  Waitable_(config.Waitable_ && !config.RealTime_ && !Buffer),
+  Scavenger_(nullptr),
+  DebugOn_(config.DebugOn_)
 {
-  allocate_new_page();
+  bool reserve;
 
-  // Handle exception
-  if (!PageList_)
+  // A reserved range (or the caller's buffer) is carved into MaxPages_
+  // equal pages. Real-time pools use one so a page is found in O(1).
+  reserve = (config.ReserveAddressSpace_ || RealTime_) && MaxPages_ && !UseCPPMemManager_;
+  if (reserve || BufferRegion_)
   {
-      throw OAException(OAException::E_NO_MEMORY,
-        "out of physical memory (operator new fails)"
-      );
+    GrowthPolicy_ = OAConfig::gpFixed;
   }
-}
 
-ObjectAllocator::~ObjectAllocator()
-{
-  GenericObject* pagewalker;
-  GenericObject* nextpage;
+  // Objects too small to hold a pointer link by slot number instead
+  if (FreeListType_ == OAConfig::flAuto)
+  {
+    FreeListType_ = ObjectSize_ < sizeof(GenericObject*) ? OAConfig::flCompressed : OAConfig::flIntrusive;
+  }
 
-  pagewalker = PageList_;
-  nextpage = nullptr;
+  // Trimming under memory pressure is the scavenger's job
+  if (CgroupAware_ && !ScavengeIntervalMs_)
+  {
+    ScavengeIntervalMs_ = PRESSURE_SAMPLE_MS;
+  }
 
-  // While a page left to delete, delete the page and walk to next page
-  while (pagewalker)
+  // Choosing a page or finding empty ones needs free lists per page
+  if (AllocPolicy_ == OAConfig::apFullestPage || ScavengeIntervalMs_)
   {
-    nextpage = pagewalker->Next;
+    if (FreeListType_ == OAConfig::flIntrusive)
+    {
+      FreeListType_ = OAConfig::flIndexStack;
+    }
+  }
+  if (AllocPolicy_ == OAConfig::apFullestPage)
+  {
+    Buckets_ = OCCUPANCY_BUCKETS;
+  }
+  for (unsigned i = 0; i < OCCUPANCY_BUCKETS; ++i)
+  {
+    Available_[i] = nullptr;
+  }
+  if (FreeListType_ == OAConfig::flCompressed)
+  {
+    LinkBytes_ = ObjectSize_ >= 4 ? 4 : ObjectSize_ >= 2 ? 2 : 1;
+    NoSlot_ = LinkBytes_ == 4 ? ~0u : (1u << (8 * LinkBytes_)) - 1;
+    if (MaxObjectsPerPage_ > NoSlot_)
+    {
+      MaxObjectsPerPage_ = NoSlot_;
+    }
+  }
+  if (FreeListType_ == OAConfig::flIndexStack)
+  {
+    unsigned blocks;
 
-    delete[] pagewalker;
+    blocks = GrowthPolicy_ == OAConfig::gpGeometric ? MaxObjectsPerPage_ : ObjectsPerPage_;
+    LinkBytes_ = blocks <= 0x100 ? 1 : blocks <= 0x10000 ? 2 : 4;
+  }
 
-    pagewalker = nextpage;
+  // Pages only carry more than the list link when they can differ in size
+  // or keep their own free chains
+  PageInfo_ = GrowthPolicy_ == OAConfig::gpGeometric || FreeListType_ != OAConfig::flIntrusive;
+  PageHeaderSize_ = PageInfo_ ? sizeof(PageHeader) : sizeof(GenericObject*);
+  PageSize_ = page_bytes(ObjectsPerPage_);
+  PageStride_ = (PageSize_ + PAGE_ALIGNMENT - 1) / PAGE_ALIGNMENT * PAGE_ALIGNMENT;
+
+  // Pages start where a PageHeader may, and as many as fit are allowed
+  if (BufferRegion_)
+  {
+    std::uintptr_t address;
+    size_t skip;
+
+    address = reinterpret_cast<std::uintptr_t>(Buffer);
+    skip = (alignof(std::max_align_t) - address % alignof(std::max_align_t)) % alignof(std::max_align_t);
+    Region_ = static_cast<char*>(Buffer) + skip;
+    RegionSize_ = BufferSize > skip ? BufferSize - skip : 0;
+    if (!MaxPages_ || MaxPages_ > RegionSize_ / PageStride_)
+    {
+      MaxPages_ = static_cast<unsigned>(RegionSize_ / PageStride_);
+    }
+    reserve = false;
+  }
+
+  // Undo whatever was built if a step fails
+  if (create_pages(config, reserve) != oaOK)
+  {
+    free_pages();
+    delete Latency_;
+    raise_error();
+  }
+
+  if ((ScavengeIntervalMs_ || Waitable_) && !RealTime_)
+  {
+    Lock_ = new std::mutex;
+  }
+
+  // Last, so the thread never sees a half-built allocator
+  if (ScavengeIntervalMs_)
+  {
+    Scavenger_ = new OAScavenger(*this, ScavengeIntervalMs_);
+    Scavenger_->Start();
   }
 }
 
-void* ObjectAllocator::Allocate(const char* label)
+// Checks the configuration and allocates the starting pages
+ObjectAllocator::OA_ERROR ObjectAllocator::create_pages(const OAConfig& config, bool reserve)
 {
-  if (UseCPPMemManager_)
+  if (OverflowMode_ == OAConfig::ofPool &&
+    (!OverflowPool_ || OverflowPool_->GetStats().ObjectSize_ < ObjectSize_))
   {
-  ++ObjectsInUse_;
-  if (MostObjects_ < ObjectsInUse_)
+    return fail(oaNoPages, "ObjectAllocator: overflow pool missing or its objects are too small");
+  }
+
+  if (RealTime_ && (!MaxPages_ || HBlockInfo_.type_ == OAConfig::hbExternal))
   {
-    MostObjects_ = ObjectsInUse_;
+    return fail(oaNoPages, "ObjectAllocator: real-time mode needs MaxPages_ and no external headers");
   }
 
-  ++Allocations_;
-    return CPPMemManagerAlloc();
+  if (FreeListType_ == OAConfig::flCompressed && ObjectsPerPage_ > NoSlot_)
+  {
+    return fail(oaNoPages, "ObjectAllocator: too many objects per page for compressed free links");
   }
 
-  // If no free space, allocate a new page
-  if (!FreeList_)
+  if (BufferRegion_)
   {
-    // If max page, throw exception
-    if (PagesInUse_ >= MaxPages_)
+    if (HBlockInfo_.type_ == OAConfig::hbExternal)
+    {
+      return fail(oaNoPages, "ObjectAllocator: external headers need the heap, not a buffer");
+    }
+    if (!MaxPages_)
     {
-      throw OAException(OAException::E_NO_PAGES,
-        "out of logical memory (max pages has been reached)"
-      );
+      return fail(oaNoPages, "ObjectAllocator: buffer is too small for one page");
     }
-    allocate_new_page();
+
+    // Growing these later would touch the heap
+    Pages_.reserve(MaxPages_);
+    FreePageIndices_.reserve(MaxPages_);
+    PageEpochs_.reserve(MaxPages_);
   }
 
-  ++Allocations_;
-  ++ObjectsInUse_;
-  if (MostObjects_ < ObjectsInUse_)
+  if (reserve)
   {
-    MostObjects_ = ObjectsInUse_;
+    RegionSize_ = PageStride_ * MaxPages_;
+    Region_ = static_cast<char*>(OAVirtualMemory::Reserve(RegionSize_));
+    if (!Region_)
+    {
+      return fail(oaNoMemory, "ObjectAllocator: cannot reserve address space.");
+    }
   }
 
-  --FreeObjects_;
-
-  // Fill in the allocated signature to the object and link the free list
-  GenericObject* nextfree;
-  char* object;
+  // Pass-through objects come from new; there is no pool to start
+  if (!UseCPPMemManager_ && !allocate_new_page())
+  {
+    return LastError();
+  }
 
-  nextfree = FreeList_->Next;
-  object = reinterpret_cast<char*>(FreeList_);
+  // Pre-populate for a known (e.g. persisted MostObjects_) object count
+  reserve_pages(config.ReserveObjects_, config.PrefaultPages_);
 
-  // Fill in the header info
-  if (HBlockInfo_.type_ == OAConfig::hbBasic)
+  // Real-time: every page now, resident and locked, so no later call has
+  // to grow, fault or ask the system for anything
+  if (RealTime_)
   {
-    char* headerwalker;
-    headerwalker = object - PadBytes_ - HBlockInfo_.size_;
-
-    headerwalker[0] = static_cast<char>(Allocations_);
-    //itoa(Allocations_, headerwalker, 10);
-    headerwalker[HBlockInfo_.size_ - 1] = 1;
+    reserve_pages(static_cast<size_t>(MaxPages_) * ObjectsPerPage_, true);
+    if (PagesInUse_ < MaxPages_)
+    {
+      return LastError();
+    }
+    if (!OAVirtualMemory::Lock(Region_, static_cast<size_t>(MaxPages_) * PageStride_))
+    {
+      return fail(oaNoMemory, "ObjectAllocator: cannot lock pages in memory (see RLIMIT_MEMLOCK)");
+    }
+    InUse_.assign(static_cast<size_t>(MaxPages_) * ObjectsPerPage_, 0);
   }
 
-  if (HBlockInfo_.type_ == OAConfig::hbExtended)
+  return oaOK;
+}
+
+ObjectAllocator::~ObjectAllocator()
+{
+  // Stop the scavenger before the pages go
+  delete Scavenger_;
+  if (RealTime_)
   {
-    char* headerwalker;
-    headerwalker = object - PadBytes_ - HBlockInfo_.size_;
+    OAVirtualMemory::Unlock(Region_, static_cast<size_t>(MaxPages_) * PageStride_);
+  }
+  free_pages();
+  CPPMemManagerFreeAll();
 
-    ++headerwalker[1];
-    headerwalker[3] = static_cast<char>(Allocations_);
-    //itoa(Allocations_, headerwalker, 10);
-    headerwalker[HBlockInfo_.size_ - 1] = 1;
+  // Objects still borrowed from a shared overflow pool go back to it
+  if (OverflowMode_ == OAConfig::ofPool)
+  {
+    for (std::unordered_set<void*>::iterator it = Overflowed_.begin(); it != Overflowed_.end(); ++it)
+    {
+      OverflowPool_->Free(*it);
+    }
   }
 
-  if (HBlockInfo_.type_ == OAConfig::hbExternal)
+  delete Latency_;
+  delete Lock_;
+
+  // A pool built later at this address starts without this one's failure
+  if (ThreadFailure.Pool == this)
   {
-    char* headerpos;
-    MemBlockInfo* extheader;
+    ThreadFailure.Pool = nullptr;
+  }
+}
 
-    headerpos = object - PadBytes_ - HBlockInfo_.size_;
-    *reinterpret_cast<MemBlockInfo**>(headerpos) = new MemBlockInfo;
-    extheader = *reinterpret_cast<MemBlockInfo**>(headerpos);
+void* ObjectAllocator::Allocate(const char* label)
+{
+  void* object;
 
-    extheader->label = new char[strlen(label) + 1];
-    strcpy(extheader->label, label);
-    extheader->alloc_num = Allocations_;
-    extheader->in_use = 1;
+  object = TryAllocate(label);
+  if (!object)
+  {
+    raise_error();
   }
 
-  for (unsigned i = 0; i < ObjectSize_; ++i)
+  return object;
+}
+
+void ObjectAllocator::Free(void* Object)
+{
+  if (TryFree(Object) != oaOK)
   {
-    object[i] = ALLOCATED_PATTERN;
+    raise_error();
   }
+}
 
-  FreeList_ = nextfree;
+void* ObjectAllocator::TryAllocate(const char* label)
+{
+  if (!Latency_ && !Trace_ && !Lock_)
+  {
+    return allocate_object(label);
+  }
 
-  return reinterpret_cast<void*>(object);
+  PoolLock lock(Lock_);
+  return try_allocate(label);
 }
 
-void ObjectAllocator::Free(void* Object)
+// TryAllocate with the lock held: the allocation, timed and traced
+void* ObjectAllocator::try_allocate(const char* label)
 {
-  --ObjectsInUse_;
-  ++Deallocations_;
+  unsigned long long start;
+  void* object;
 
-  GenericObject* castedobject;
-  castedobject = reinterpret_cast<GenericObject*>(Object);
+  start = Latency_ ? OAClock::Ticks() : 0;
+  object = allocate_object(label);
 
-  if (UseCPPMemManager_)
+  if (Latency_)
   {
-    CPPMemManagerFree(castedobject);
-    return;;
+    Latency_->Allocate_.Record(OAClock::Ticks() - start);
+  }
+  if (Trace_ && object)
+  {
+    Trace_->Record(TracePool_, OATraceRecorder::opAllocate, object, label);
   }
 
-  // Make sure this object hasn't been freed yet
-  if (IsOnFreeList(castedobject))
+  return object;
+}
+
+ObjectAllocator::OA_ERROR ObjectAllocator::TryFree(void* Object)
+{
+  if (!Latency_ && !Trace_ && !Lock_)
   {
-    throw OAException(OAException::E_MULTIPLE_FREE,
-      "FreeObject: Object has already been freed."
-    );
+    return free_object(Object);
   }
 
-  // Make sure this object is not on bad boundary
-  if (IsOnBadBoundary(castedobject))
+  PoolLock lock(Lock_);
+  return try_free(Object);
+}
+
+// TryFree with the lock held: the free, timed and traced, and the hand-off
+// to a waiter
+ObjectAllocator::OA_ERROR ObjectAllocator::try_free(void* Object)
+{
+  unsigned long long start;
+  OA_ERROR error;
+
+  start = Latency_ ? OAClock::Ticks() : 0;
+  error = free_object(Object);
+
+  if (Latency_)
+  {
+    Latency_->Free_.Record(OAClock::Ticks() - start);
+  }
+  if (Trace_ && error == oaOK)
   {
-    throw OAException(OAException::E_BAD_BOUNDARY,
-      "block address is on a page, but not on any block-boundary"
-    );
+    Trace_->Record(TracePool_, OATraceRecorder::opFree, Object, nullptr);
   }
 
-  // Make sure this object does not have corrupted block
-  if (HasCorruptedBlock(Object))
+  // The freed block goes straight to the longest waiting thread
+  if (error == oaOK && !Waiters_.empty())
   {
-    throw OAException(OAException::E_CORRUPTED_BLOCK,
-      "left block has been corrupted (pad bytes have been overwritten)"
-    );
+    hand_off();
   }
 
-  // Fill in free memory signature
-  char* objectfiller;
+  return error;
+}
 
-  objectfiller = reinterpret_cast<char*>(Object);
+void* ObjectAllocator::AllocateWait(unsigned TimeoutMs, const char* label)
+{
+  if (!Waitable_)
+  {
+    return try_once(label);
+  }
 
-  // Modify header when freeing
-  if (HBlockInfo_.type_ == OAConfig::hbBasic)
+  std::unique_lock<std::mutex> lock(*Lock_);
+  std::chrono::steady_clock::time_point deadline;
+  std::deque<OAWaiter*>::iterator found;
+  std::condition_variable ready;
+  OAWaiter waiter;
+  void* object;
+
+  waiter.Label = label;
+  waiter.Wake = wake_thread;
+  waiter.Context = &ready;
+  object = allocate_or_queue(waiter);
+  if (object)
   {
-    char* headerwalker;
-    headerwalker = objectfiller - PadBytes_ - HBlockInfo_.size_;
+    return object;
+  }
 
-    headerwalker[0] = 0;
-    headerwalker[HBlockInfo_.size_ - 1] = 0;
+  deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(TimeoutMs);
+  ready.wait_until(lock, deadline, [&waiter] { return waiter.Block != nullptr; });
+
+  // Timed out: leave the line (a Free may have served us just in time)
+  if (!waiter.Block)
+  {
+    found = std::find(Waiters_.begin(), Waiters_.end(), &waiter);
+    if (found != Waiters_.end())
+    {
+      Waiters_.erase(found);
+    }
+    fail(oaNoPages, "AllocateWait: timed out waiting for a free block");
   }
 
-  if (HBlockInfo_.type_ == OAConfig::hbExtended)
+  return waiter.Block;
+}
+
+void* ObjectAllocator::AllocateOrQueue(OAWaiter& waiter)
+{
+  if (!Waitable_)
   {
-    char* headerwalker;
-    headerwalker = objectfiller - PadBytes_ - HBlockInfo_.size_;
+    waiter.Block = nullptr;
+    return try_once(waiter.Label);
+  }
 
-    headerwalker[3] = 0;
-    headerwalker[HBlockInfo_.size_ - 1] = 0;
+  PoolLock lock(Lock_);
+
+  return allocate_or_queue(waiter);
+}
+
+bool ObjectAllocator::IsWaitable() const
+{
+  return Waitable_;
+}
+
+// One TryAllocate for a pool that can't wait: null when it is full,
+// thrown like Allocate for any other failure
+void* ObjectAllocator::try_once(const char* label)
+{
+  void* object;
+
+  object = TryAllocate(label);
+  if (!object && LastError() != oaNoPages)
+  {
+    raise_error();
   }
 
-  if (HBlockInfo_.type_ == OAConfig::hbExternal)
+  return object;
+}
+
+// A block now, or null with waiter at the back of the line. Nobody jumps
+// the queue: with waiters present, get in line. Called with the lock held.
+void* ObjectAllocator::allocate_or_queue(OAWaiter& waiter)
+{
+  void* object;
+
+  waiter.Block = nullptr;
+  if (Waiters_.empty())
   {
-    char* headerpos;
-    MemBlockInfo** extheader;
+    object = allocate_object(waiter.Label);
+    if (object)
+    {
+      if (Trace_)
+      {
+        Trace_->Record(TracePool_, OATraceRecorder::opAllocate, object, waiter.Label);
+      }
+      return object;
+    }
+    if (LastError() != oaNoPages)
+    {
+      raise_error();
+    }
+  }
 
-    headerpos = reinterpret_cast<char*>(Object) - PadBytes_ - HBlockInfo_.size_;
-    extheader = reinterpret_cast<MemBlockInfo**>(headerpos);
+  Waiters_.push_back(&waiter);
+  return nullptr;
+}
 
-    delete[] (*extheader)->label;
-    (*extheader)->label = nullptr;
-    delete[] *extheader;
-    *extheader = nullptr;
+// Allocates for the first waiter and wakes it alone. Called with the lock
+// held, right after a Free made a block available.
+void ObjectAllocator::hand_off()
+{
+  OAWaiter* waiter;
+
+  waiter = Waiters_.front();
+  waiter->Block = allocate_object(waiter->Label);
+  if (!waiter->Block)
+  {
+    return;
   }
 
-  for (unsigned i = 0; i < ObjectSize_; ++i)
+  Waiters_.pop_front();
+  if (Trace_)
   {
-    objectfiller[i] = FREED_PATTERN;
+    Trace_->Record(TracePool_, OATraceRecorder::opAllocate, waiter->Block, waiter->Label);
   }
+  waiter->Wake(waiter);
+}
 
-  // Link the free list
-  castedobject->Next = FreeList_;
-  FreeList_ = castedobject;
+ObjectAllocator::OA_ERROR ObjectAllocator::LastError() const
+{
+  return ThreadFailure.Pool == this ? ThreadFailure.Error : oaOK;
+}
 
-  ++FreeObjects_;
+const char* ObjectAllocator::LastErrorMessage() const
+{
+  return ThreadFailure.Pool == this ? ThreadFailure.Message : "";
 }
 
-unsigned ObjectAllocator::DumpMemoryInUse(DUMPCALLBACK fn) const
+// Records a failure of this thread for LastError and raise_error; returns error
+ObjectAllocator::OA_ERROR ObjectAllocator::fail(OA_ERROR error, const char* message)
 {
-  //unsigned leakct;
-  //GenericObject* pagewalker;
+  ThreadFailure.Pool = this;
+  ThreadFailure.Error = error;
+  ThreadFailure.Message = message;
+  return error;
+}
 
-  //leakct = 0;
-  //pagewalker = PageList_;
-  //while (pagewalker)
-  //{
-  //  char* objwalker;
-  //  char* pageend;
+// Turns this thread's last failure into an OAException (or an abort)
+void ObjectAllocator::raise_error() const
+{
+  OARaise(static_cast<OAException::OA_EXCEPTION>(LastError() - 1), LastErrorMessage());
+}
 
-  //  objwalker = reinterpret_cast<char*>(PageList_) + HBlockInfo_.size_
-  //  + PadBytes_
+void OARaise(OAException::OA_EXCEPTION code, const char* message)
+{
+#if OA_EXCEPTIONS
+  throw OAException(code, message);
+#else
+  std::fprintf(stderr, "OAException %d: %s\n", static_cast<int>(code), message);
+  std::abort();
+#endif
+}
+
+void* ObjectAllocator::allocate_object(const char* label)
+{
+  if (UseCPPMemManager_)
+  {
+    void* object;
+
+    object = CPPMemManagerAlloc();
+    if (!object)
+    {
+      return nullptr;
+    }
+
+  ++ObjectsInUse_;
+  if (MostObjects_ < ObjectsInUse_)
+  {
+    MostObjects_ = ObjectsInUse_;
+  }
+
+  ++Allocations_;
+    return object;
+  }
+
+  // If no free space, allocate a new page
+  if (!FreeList_ && !first_available())
+  {
+    // If max page, fail (0 = unlimited)
+    if (MaxPages_ && PagesInUse_ >= MaxPages_)
+    {
+      // The pool stays bounded; the burst goes to the overflow source
+      if (OverflowMode_ != OAConfig::ofNone)
+      {
+        return allocate_overflow(label);
+      }
+      fail(oaNoPages, "out of logical memory (max pages has been reached)");
+      return nullptr;
+    }
+    // Fail here rather than be OOM-killed by the cgroup
+    if (CgroupAware_ && memory_tight(PageSize_))
+    {
+      fail(oaNoMemory, "out of physical memory (cgroup memory limit or pressure)");
+      return nullptr;
+    }
+    if (!allocate_new_page())
+    {
+      return nullptr;
+    }
+  }
+
+  // An external header comes from the heap: get it before the pool changes,
+  // so running out is oaNoMemory with nothing to undo
+  MemBlockInfo* extheader = nullptr;
+
+  if (HBlockInfo_.type_ == OAConfig::hbExternal)
+  {
+    extheader = new (std::nothrow) MemBlockInfo;
+    if (extheader)
+    {
+      extheader->label = new (std::nothrow) char[strlen(label) + 1];
+    }
+    if (!extheader || !extheader->label)
+    {
+      delete extheader;
+      fail(oaNoMemory, "out of physical memory (external block header)");
+      return nullptr;
+    }
+  }
+
+  ++Allocations_;
+  ++ObjectsInUse_;
+  if (MostObjects_ < ObjectsInUse_)
+  {
+    MostObjects_ = ObjectsInUse_;
+  }
+
+  --FreeObjects_;
+
+  // Fill in the allocated signature to the object and link the free list
+  char* object;
+
+  object = pop_free_block();
+  if (RealTime_)
+  {
+    set_in_use(object, 1);
+  }
+
+  // Fill in the header info
+  if (HBlockInfo_.type_ == OAConfig::hbBasic)
+  {
+    char* headerwalker;
+    headerwalker = object - PadBytes_ - HBlockInfo_.size_;
+
+    headerwalker[0] = static_cast<char>(Allocations_);
+    //itoa(Allocations_, headerwalker, 10);
+    headerwalker[HBlockInfo_.size_ - 1] = 1;
+  }
+
+  if (HBlockInfo_.type_ == OAConfig::hbExtended)
+  {
+    char* headerwalker;
+    headerwalker = object - PadBytes_ - HBlockInfo_.size_;
+
+    bump_use_count(headerwalker);
+    headerwalker[3] = static_cast<char>(Allocations_);
+    //itoa(Allocations_, headerwalker, 10);
+    headerwalker[HBlockInfo_.size_ - 1] = 1;
+  }
+
+  if (HBlockInfo_.type_ == OAConfig::hbExternal)
+  {
+    char* headerpos;
+
+    headerpos = object - PadBytes_ - HBlockInfo_.size_;
+    *reinterpret_cast<MemBlockInfo**>(headerpos) = extheader;
+
+    strcpy(extheader->label, label);
+    extheader->alloc_num = Allocations_;
+    extheader->in_use = 1;
+  }
+
+  // The index stack leaves the block cold until the client writes it
+  if (DebugOn_ || FreeListType_ != OAConfig::flIndexStack)
+  {
+  for (unsigned i = 0; i < ObjectSize_; ++i)
+  {
+    object[i] = ALLOCATED_PATTERN;
+  }
+  }
+
+  return reinterpret_cast<void*>(object);
+}
+
+// Serves an allocation past MaxPages_ from the heap or the overflow pool
+void* ObjectAllocator::allocate_overflow(const char* label)
+{
+  void* object;
+
+  if (OverflowMode_ == OAConfig::ofPool)
+  {
+    object = OverflowPool_->TryAllocate(label);
+    if (!object)
+    {
+      fail(OverflowPool_->LastError(), OverflowPool_->LastErrorMessage());
+      return nullptr;
+    }
+  }
+  else
+  {
+    object = CPPMemManagerAlloc();
+    if (!object)
+    {
+      return nullptr;
+    }
+  }
+
+  // Tracking the object is the one step that allocates: if the heap is out,
+  // hand the object back and fail like any other allocation
+#if OA_EXCEPTIONS
+  try
+  {
+#endif
+    Overflowed_.insert(object);
+#if OA_EXCEPTIONS
+  }
+  catch (const std::bad_alloc&)
+  {
+    free_overflow(object);
+    fail(oaNoMemory, "out of physical memory (cannot track an overflow object)");
+    return nullptr;
+  }
+#endif
+
+  ++Allocations_;
+  ++ObjectsInUse_;
+  if (MostObjects_ < ObjectsInUse_)
+  {
+    MostObjects_ = ObjectsInUse_;
+  }
+  ++OverflowAllocations_;
+
+  return object;
+}
+
+ObjectAllocator::OA_ERROR ObjectAllocator::free_overflow(void* Object)
+{
+  if (OverflowMode_ == OAConfig::ofPool)
+  {
+    if (OverflowPool_->TryFree(Object) != oaOK)
+    {
+      return fail(OverflowPool_->LastError(), OverflowPool_->LastErrorMessage());
+    }
+  }
+  else
+  {
+    CPPMemManagerFree(reinterpret_cast<GenericObject*>(Object));
+  }
+
+  return oaOK;
+}
+
+ObjectAllocator::OA_ERROR ObjectAllocator::free_object(void* Object)
+{
+  GenericObject* castedobject;
+  castedobject = reinterpret_cast<GenericObject*>(Object);
+
+  if (UseCPPMemManager_)
+  {
+    --ObjectsInUse_;
+    ++Deallocations_;
+    CPPMemManagerFree(castedobject);
+    return oaOK;
+  }
+
+  // Overflow objects go back where they came from. A free the overflow pool
+  // refuses leaves the object tracked and the counts as they were.
+  if (!Overflowed_.empty() && Overflowed_.count(Object))
+  {
+    if (free_overflow(Object) != oaOK)
+    {
+      return LastError();
+    }
+    Overflowed_.erase(Object);
+    --ObjectsInUse_;
+    ++Deallocations_;
+    return oaOK;
+  }
+
+  // Make sure this object hasn't been freed yet
+  if (IsOnFreeList(castedobject))
+  {
+    return fail(oaMultipleFree, "FreeObject: Object has already been freed.");
+  }
+
+  // Make sure this object is not on bad boundary
+  if (IsOnBadBoundary(castedobject))
+  {
+    return fail(oaBadBoundary, "block address is on a page, but not on any block-boundary");
+  }
+
+  // Make sure this object does not have corrupted block
+  if (HasCorruptedBlock(Object))
+  {
+    return fail(oaCorruptedBlock, "left block has been corrupted (pad bytes have been overwritten)");
+  }
+
+  // Only a block that passed the checks counts as freed
+  --ObjectsInUse_;
+  ++Deallocations_;
+  if (RealTime_)
+  {
+    set_in_use(Object, 0);
+  }
+
+  // Fill in free memory signature
+  char* objectfiller;
+
+  objectfiller = reinterpret_cast<char*>(Object);
+
+  // Modify header when freeing
+  if (HBlockInfo_.type_ == OAConfig::hbBasic)
+  {
+    char* headerwalker;
+    headerwalker = objectfiller - PadBytes_ - HBlockInfo_.size_;
+
+    headerwalker[0] = 0;
+    headerwalker[HBlockInfo_.size_ - 1] = 0;
+  }
+
+  if (HBlockInfo_.type_ == OAConfig::hbExtended)
+  {
+    char* headerwalker;
+    headerwalker = objectfiller - PadBytes_ - HBlockInfo_.size_;
+
+    headerwalker[3] = 0;
+    headerwalker[HBlockInfo_.size_ - 1] = 0;
+  }
+
+  if (HBlockInfo_.type_ == OAConfig::hbExternal)
+  {
+    char* headerpos;
+    MemBlockInfo** extheader;
+
+    headerpos = reinterpret_cast<char*>(Object) - PadBytes_ - HBlockInfo_.size_;
+    extheader = reinterpret_cast<MemBlockInfo**>(headerpos);
+
+    delete[] (*extheader)->label;
+    (*extheader)->label = nullptr;
+    delete[] *extheader;
+    *extheader = nullptr;
+  }
+
+  if (DebugOn_ || FreeListType_ != OAConfig::flIndexStack)
+  {
+  for (unsigned i = 0; i < ObjectSize_; ++i)
+  {
+    objectfiller[i] = FREED_PATTERN;
+  }
+  }
+
+  // Link the free list
+  push_free_block(objectfiller);
+
+  ++FreeObjects_;
+  return oaOK;
+}
+
+unsigned ObjectAllocator::DumpMemoryInUse(DUMPCALLBACK fn) const
+{
+  //unsigned leakct;
+  //GenericObject* pagewalker;
+
+  //leakct = 0;
+  //pagewalker = PageList_;
+  //while (pagewalker)
+  //{
+  //  char* objwalker;
+  //  char* pageend;
+
+  //  objwalker = reinterpret_cast<char*>(PageList_) + HBlockInfo_.size_
+  //  + PadBytes_
   //  ;
   //  pageend = reinterpret_cast<char*>(pagewalker) + PageSize_;
   //  while (objwalker < pageend)
@@ -284,48 +972,208 @@ unsigned ObjectAllocator::ValidatePages(VALIDATECALLBACK fn) const
 
 unsigned ObjectAllocator::FreeEmptyPages()
 {
-  return 0;
-}
+  PoolLock lock(Lock_);
 
-bool ObjectAllocator::ImplementedExtraCredit()
-{
-  return false;
+  return release_sparse_pages(false, nullptr, nullptr);
 }
 
-void ObjectAllocator::SetDebugState(bool State)
+unsigned ObjectAllocator::Compact(RELOCATECALLBACK fn, void* Context)
 {
-  tmp_ = State;
-}
+  PoolLock lock(Lock_);
 
-const void* ObjectAllocator::GetFreeList() const
-{
-  return reinterpret_cast<const void*>(FreeList_);
+  return release_sparse_pages(true, fn, Context);
 }
 
-const void* ObjectAllocator::GetPageList() const
+unsigned ObjectAllocator::Scavenge()
 {
-  return reinterpret_cast<const void*>(PageList_);
-}
+  if (!Scavenger_)
+  {
+    return 0;
+  }
 
-OAConfig ObjectAllocator::GetConfig() const
-{
-  // Make new stats object and copy member variables from private
-  OAConfig config;
+  PoolLock lock(Lock_);
+  typedef std::pair<unsigned long long, unsigned> EmptyPage;
+  std::vector<EmptyPage> empty;
+  std::vector<char> marked;
+  unsigned long long now;
+  unsigned long long decay;
+  unsigned spares;
+  unsigned released;
+
+  // Under memory pressure no empty page is worth keeping
+  spares = ScavengeSparePages_;
+  decay = static_cast<unsigned long long>(OAClock::TicksPerSecond() * ScavengeDecayMs_ / 1000.0);
+  if (CgroupAware_ && memory_tight(0))
+  {
+    spares = 0;
+    decay = 0;
+  }
 
-  config.PadBytes_ = PadBytes_;
-  config.ObjectsPerPage_ = ObjectsPerPage_;
+  for (unsigned i = 0; i < Pages_.size(); ++i)
+  {
+    PageHeader* header;
+
+    header = reinterpret_cast<PageHeader*>(Pages_[i]);
+    if (header && header->FreeCount == header->Blocks)
+    {
+      empty.push_back(EmptyPage(header->EmptySince, i));
+    }
+  }
+
+  if (empty.size() <= spares)
+  {
+    return 0;
+  }
+
+  // The most recently emptied pages are the spares; older ones go once
+  // they have sat empty for the decay time
+  std::sort(empty.begin(), empty.end());
+  now = OAClock::Ticks();
+  marked.assign(Pages_.size(), 0);
+  released = 0;
+  for (size_t i = 0; i < empty.size() - spares; ++i)
+  {
+    if (now < empty[i].first || now - empty[i].first < decay)
+    {
+      break;
+    }
+    marked[empty[i].second] = 1;
+    ++released;
+  }
+
+  if (!released)
+  {
+    return 0;
+  }
+
+  return release_marked_pages(marked);
+}
+
+size_t ObjectAllocator::DiscardFreeMemory()
+{
+  PoolLock lock(Lock_);
+  // Free blocks must hold nothing worth keeping: no links, no pad
+  // signatures, no use counters. A caller's buffer isn't ours to give back,
+  // and real-time pages must stay resident.
+  if (FreeListType_ != OAConfig::flIndexStack || PadBytes_ ||
+    HBlockInfo_.type_ == OAConfig::hbExtended || DebugOn_ || BufferRegion_ || RealTime_)
+  {
+    return 0;
+  }
+
+  std::vector<unsigned> slots;
+  size_t discarded;
+
+  discarded = 0;
+  for (unsigned index = 0; index < Pages_.size(); ++index)
+  {
+    GenericObject* pagewalker;
+    PageHeader* header;
+    char* stack;
+
+    pagewalker = Pages_[index];
+    if (!pagewalker || !reinterpret_cast<PageHeader*>(pagewalker)->FreeCount)
+    {
+      continue;
+    }
+
+    header = reinterpret_cast<PageHeader*>(pagewalker);
+    stack = page_stack(pagewalker);
+
+    slots.clear();
+    for (unsigned i = 0; i < header->FreeCount; ++i)
+    {
+      slots.push_back(read_link(stack + i * LinkBytes_));
+    }
+    std::sort(slots.begin(), slots.end());
+
+    // Each run of adjacent free slots is one range (headers included)
+    for (size_t first = 0, last = 0; first < slots.size(); first = last)
+    {
+      char* begin;
+      char* end;
+
+      for (last = first + 1; last < slots.size() && slots[last] == slots[last - 1] + 1; ++last)
+      {
+      }
+
+      begin = slot_block(pagewalker, slots[first]) - HBlockInfo_.size_;
+      end = slot_block(pagewalker, slots[last - 1]) + ObjectSize_;
+      discarded += OAVirtualMemory::Discard(begin, static_cast<size_t>(end - begin));
+    }
+  }
+
+  return discarded;
+}
+
+bool ObjectAllocator::ImplementedExtraCredit()
+{
+  return false;
+}
+
+void ObjectAllocator::SetDebugState(bool State)
+{
+  DebugOn_ = State;
+}
+
+const void* ObjectAllocator::GetFreeList() const
+{
+  // Per-page free lists have no global list; the pages with free blocks stand in
+  if (FreeListType_ != OAConfig::flIntrusive)
+  {
+    return reinterpret_cast<const void*>(first_available());
+  }
+
+  return reinterpret_cast<const void*>(FreeList_);
+}
+
+const void* ObjectAllocator::GetPageList() const
+{
+  return reinterpret_cast<const void*>(PageList_);
+}
+
+OAConfig ObjectAllocator::GetConfig() const
+{
+  // Make new stats object and copy member variables from private
+  OAConfig config;
+
+  config.PadBytes_ = PadBytes_;
+  config.ObjectsPerPage_ = ObjectsPerPage_;
   config.MaxPages_ = MaxPages_;
   config.Alignment_ = Alignment_;
   config.LeftAlignSize_ = LeftAlignSize_;
   config.InterAlignSize_ = InterAlignSize_;
   config.HBlockInfo_ = HBlockInfo_;
   config.UseCPPMemManager_ = UseCPPMemManager_;
+  config.DebugOn_ = DebugOn_;
+  config.LatencyStats_ = Latency_ != nullptr;
+  config.TraceRecorder_ = Trace_;
+  config.GrowthPolicy_ = GrowthPolicy_;
+  config.MaxObjectsPerPage_ = MaxObjectsPerPage_;
+  config.ReserveObjects_ = ReserveObjects_;
+  config.PrefaultPages_ = PrefaultPages_;
+  config.ReserveAddressSpace_ = Region_ != nullptr && !BufferRegion_;
+  config.FreeListType_ = FreeListType_;
+  config.AllocPolicy_ = AllocPolicy_;
+  config.ScavengeIntervalMs_ = ScavengeIntervalMs_;
+  config.ScavengeSparePages_ = ScavengeSparePages_;
+  config.ScavengeDecayMs_ = ScavengeDecayMs_;
+  config.CgroupAware_ = CgroupAware_;
+  config.CgroupHeadroomPct_ = CgroupHeadroomPct_;
+  config.PressureAvg10_ = PressureAvg10_;
+  config.OverflowMode_ = OverflowMode_;
+  config.OverflowPool_ = OverflowPool_;
+  config.UsePageCache_ = UsePageCache_;
+  config.RealTime_ = RealTime_;
+  config.Waitable_ = Waitable_;
+  config.PageSource_ = PageSource_ == heap_pages() || PageSource_ == cached_pages() ? nullptr : PageSource_;
 
   return config;
 }
 
 OAStats ObjectAllocator::GetStats() const
 {
+  PoolLock lock(Lock_);
   // Make new stats object and copy member variables from private
   OAStats stats;
 
@@ -337,146 +1185,1134 @@ OAStats ObjectAllocator::GetStats() const
   stats.Allocations_ = Allocations_;
   stats.Deallocations_ = Deallocations_;
   stats.MostObjects_ = MostObjects_;
+  stats.OverflowInUse_ = static_cast<unsigned>(Overflowed_.size());
+  stats.OverflowAllocations_ = OverflowAllocations_;
+
+  // Free blocks stranded on pages that still hold objects
+  unsigned capacity;
+  unsigned stranded;
+
+  capacity = FreeObjects_ + ObjectsInUse_ - stats.OverflowInUse_;
+  stranded = FreeListType_ == OAConfig::flIntrusive ? FreeObjects_ : FreeObjects_ - EmptyPageBlocks_;
+  stats.Fragmentation_ = capacity ? static_cast<double>(stranded) / capacity : 0.0;
+
+  return stats;
+}
+
+unsigned ObjectAllocator::Reserve(size_t objects, bool prefault)
+{
+  PoolLock lock(Lock_);
+  unsigned pages;
+
+  pages = reserve_pages(objects, prefault);
+
+  if (FreeObjects_ + ObjectsInUse_ < objects && !UseCPPMemManager_)
+  {
+    // Short because of MaxPages_, or else a new page failed
+    if (MaxPages_ && PagesInUse_ >= MaxPages_)
+    {
+      fail(oaNoPages, "Reserve: max pages reached before the requested capacity");
+    }
+    raise_error();
+  }
+
+  return pages;
+}
+
+bool ObjectAllocator::Locate(const void* Object, unsigned& Page, unsigned& Slot) const
+{
+  PoolLock lock(Lock_);
+  return locate(Object, Page, Slot);
+}
+
+void* ObjectAllocator::BlockAt(unsigned Page, unsigned Slot) const
+{
+  PoolLock lock(Lock_);
+  return block_at(Page, Slot);
+}
+
+// BlockAt without the lock
+void* ObjectAllocator::block_at(unsigned Page, unsigned Slot) const
+{
+  if (Page >= Pages_.size() || !Pages_[Page] || Slot >= page_blocks(Pages_[Page]))
+  {
+    return nullptr;
+  }
+
+  return reinterpret_cast<char*>(Pages_[Page]) + PageHeaderSize_ + HBlockInfo_.size_ + PadBytes_
+    + Slot * BlockSize_;
+}
+
+unsigned ObjectAllocator::UseCount(const void* Object) const
+{
+  PoolLock lock(Lock_);
+  return use_count(Object);
+}
+
+// UseCount without the lock (HandleAllocator's Compact callback runs under it)
+unsigned ObjectAllocator::use_count(const void* Object) const
+{
+  const char* headerwalker;
+  unsigned short usecount;
+
+  if (HBlockInfo_.type_ != OAConfig::hbExtended)
+  {
+    return 0;
+  }
+
+  headerwalker = static_cast<const char*>(Object) - PadBytes_ - HBlockInfo_.size_;
+
+  // The flag byte is cleared when the block is freed
+  if (!headerwalker[HBlockInfo_.size_ - 1])
+  {
+    return 0;
+  }
+
+  std::memcpy(&usecount, headerwalker + EXTENDED_USE_COUNT, sizeof(usecount));
+  return usecount;
+}
+
+bool ObjectAllocator::GetLatencyStats(OALatencyStats& Stats) const
+{
+  PoolLock lock(Lock_);
+  if (!Latency_)
+  {
+    return false;
+  }
+
+  Stats = *Latency_;
+  return true;
+}
+
+void ObjectAllocator::ResetLatencyStats()
+{
+  PoolLock lock(Lock_);
+  if (Latency_)
+  {
+    Latency_->Allocate_.Reset();
+    Latency_->Free_.Reset();
+    Latency_->NewPage_.Reset();
+  }
+}
+
+bool ObjectAllocator::allocate_new_page()
+{
+  unsigned long long start;
+  unsigned blocks;
+  unsigned index;
+  size_t pagesize;
+  char* newpage;
+  char* blocksend;
+
+  start = Latency_ ? OAClock::Ticks() : 0;
+  blocks = NextPageBlocks_;
+  pagesize = page_bytes(blocks);
+
+  // Past acquire_page nothing may fail, so the page index grows first
+  if (!reserve_page_index())
+  {
+    return false;
+  }
+
+  newpage = acquire_page(pagesize, index);
+  if (!newpage)
+  {
+    return false;
+  }
+  blocksend = newpage + PageHeaderSize_ + blocks * BlockSize_;
+
+  // Fill in unallocated memory signature
+  if (DebugOn_ || FreeListType_ != OAConfig::flIndexStack)
+  {
+  for (size_t i = 0; i < pagesize; ++i)
+  {
+    newpage[i] = UNALLOCATED_PATTERN;
+  }
+  }
+
+  // Fill in padding memory signature
+  if (PadBytes_)
+  {
+    char* padwalker;
+    char* pageend;
+
+    padwalker = newpage + PageHeaderSize_ + HBlockInfo_.size_;
+    pageend = blocksend;
+
+    while (true)
+    {
+      for (unsigned i = 0; i < PadBytes_; ++i)
+      {
+        padwalker[i] = PAD_PATTERN;
+      }
+
+      padwalker += PadBytes_ + ObjectSize_;
+
+      if (padwalker >= pageend)
+      {
+        break;
+      }
+
+      for (unsigned i = 0; i < PadBytes_; ++i)
+      {
+        padwalker[i] = PAD_PATTERN;
+      }
+
+      padwalker += PadBytes_ + HBlockInfo_.size_;
+
+      if (padwalker >= pageend)
+      {
+        break;
+      }
+    }
+  }
+
+  // Fill in header memory signature
+  if (HBlockInfo_.size_)
+  {
+    char* headerwalker;
+    char* pageend;
+
+    headerwalker = newpage + PageHeaderSize_;
+    pageend = blocksend;
+
+    while (headerwalker < pageend)
+    {
+      #define HEADER_PATTERN 0x00
+
+      for (unsigned i = 0; i < HBlockInfo_.size_; ++i)
+      {
+        headerwalker[i] = HEADER_PATTERN;
+      }
+
+      // A reused index carries on its old page's use counts
+      if (HBlockInfo_.type_ == OAConfig::hbExtended && index < PageEpochs_.size())
+      {
+        std::memcpy(headerwalker + EXTENDED_USE_COUNT, &PageEpochs_[index], sizeof(PageEpochs_[index]));
+      }
+
+      headerwalker += HBlockInfo_.size_ + 2 * PadBytes_ + ObjectSize_;
+    }
+  }
+
+  GenericObject* castedpage;
+
+  castedpage = reinterpret_cast<GenericObject*>(newpage);
+
+  // Link the page list
+  GenericObject* nextpage = PageList_;
+  PageList_ = castedpage;
+  PageList_->Next = nextpage;
+
+  if (PageInfo_)
+  {
+    reinterpret_cast<PageHeader*>(newpage)->Blocks = blocks;
+  }
+  if (index == Pages_.size())
+  {
+    Pages_.push_back(castedpage);
+  }
+  else
+  {
+    Pages_[index] = castedpage;
+  }
+  if (!Region_)
+  {
+    std::pair<std::uintptr_t, unsigned> span(reinterpret_cast<std::uintptr_t>(newpage), index);
+
+    PageSpans_.insert(std::upper_bound(PageSpans_.begin(), PageSpans_.end(), span), span);
+  }
+
+  // Per-page free lists: the page joins the available pages
+  if (FreeListType_ != OAConfig::flIntrusive)
+  {
+    PageHeader* header;
+
+    header = reinterpret_cast<PageHeader*>(newpage);
+    header->FreeCount = blocks;
+    header->Bucket = ~0u;
+    header->EmptySince = ScavengeIntervalMs_ ? OAClock::Ticks() : 0;
+    EmptyPageBlocks_ += blocks;
+    update_available(castedpage);
+  }
+
+  // Compressed links: chain the slots in address order on the page itself
+  if (FreeListType_ == OAConfig::flCompressed)
+  {
+    PageHeader* header;
+
+    header = reinterpret_cast<PageHeader*>(newpage);
+    for (unsigned i = 0; i < blocks; ++i)
+    {
+      write_link(slot_block(castedpage, i), i + 1 < blocks ? i + 1 : NoSlot_);
+    }
+    header->FreeHead = 0;
+  }
+  // Index stack: every slot, with slot 0 on top
+  else if (FreeListType_ == OAConfig::flIndexStack)
+  {
+    char* stack;
+
+    stack = page_stack(castedpage);
+    for (unsigned i = 0; i < blocks; ++i)
+    {
+      write_link(stack + i * LinkBytes_, blocks - 1 - i);
+    }
+  }
+  else
+  {
+  // Link free list
+  // todo: handle allignments
+  char* placeholder;
+  GenericObject* freelistwalker;
+  GenericObject* nextfree = FreeList_;
+
+  placeholder = newpage + PageHeaderSize_ + HBlockInfo_.size_
+  + PadBytes_
+  ;
+  freelistwalker = reinterpret_cast<GenericObject*>(placeholder);
+  FreeList_ = freelistwalker;
+  FreeList_->Next = nextfree;
+
+  for (unsigned i = 0; i < blocks - 1; ++i)
+  {
+    placeholder += BlockSize_;
+    freelistwalker = reinterpret_cast<GenericObject*>(placeholder);
+    freelistwalker->Next = FreeList_;
+    FreeList_ = freelistwalker;
+  }
+  }
+
+  // Handle private stats
+  ++PagesInUse_;
+  FreeObjects_ += blocks;
+
+  // Geometric growth: each page holds twice the blocks of the previous one
+  if (GrowthPolicy_ == OAConfig::gpGeometric && NextPageBlocks_ < MaxObjectsPerPage_)
+  {
+    NextPageBlocks_ = NextPageBlocks_ > MaxObjectsPerPage_ / 2 ? MaxObjectsPerPage_ : NextPageBlocks_ * 2;
+  }
+
+  if (Latency_)
+  {
+    Latency_->NewPage_.Record(OAClock::Ticks() - start);
+  }
+  if (Trace_)
+  {
+    Trace_->Record(TracePool_, OATraceRecorder::opNewPage, newpage, nullptr);
+  }
+
+  return true;
+}
+
+// Room for one more page in Pages_ and PageSpans_ (and for every index in
+// FreePageIndices_), so adding or releasing a page never allocates. Out of
+// heap is oaNoMemory here, not a bad_alloc out of TryAllocate.
+bool ObjectAllocator::reserve_page_index()
+{
+#if OA_EXCEPTIONS
+  try
+  {
+#endif
+    if (Pages_.size() == Pages_.capacity())
+    {
+      Pages_.reserve(2 * Pages_.size() + 1);
+    }
+    FreePageIndices_.reserve(Pages_.capacity());
+    if (!Region_ && PageSpans_.size() == PageSpans_.capacity())
+    {
+      PageSpans_.reserve(2 * PageSpans_.size() + 1);
+    }
+#if OA_EXCEPTIONS
+  }
+  catch (const std::bad_alloc&)
+  {
+    fail(oaNoMemory, "allocate_new_page: no memory for the page index.");
+    return false;
+  }
+#endif
+
+  return true;
+}
+
+// Memory and a Pages_ index for a new page (released indices first). Pages
+// of a reserved range are committed at the slot matching their index.
+char* ObjectAllocator::acquire_page(size_t bytes, unsigned& index)
+{
+  char* page;
+
+  index = FreePageIndices_.empty() ? static_cast<unsigned>(Pages_.size()) : FreePageIndices_.back();
+
+  if (Region_)
+  {
+    if (index >= MaxPages_)
+    {
+      fail(oaNoPages, "acquire_page: reserved range is full.");
+      return nullptr;
+    }
+
+    page = Region_ + index * PageStride_;
+    if (!BufferRegion_ && !OAVirtualMemory::Commit(page, bytes))
+    {
+      fail(oaNoMemory, "acquire_page: cannot commit page.");
+      return nullptr;
+    }
+  }
+  else
+  {
+    // Report an exhausted page source as our own error
+    page = static_cast<char*>(PageSource_->Acquire(bytes, PAGE_ALIGNMENT));
+    if (!page)
+    {
+      fail(oaNoMemory, "allocate_new_page: No system memory available.");
+      return nullptr;
+    }
+  }
+
+  if (!FreePageIndices_.empty())
+  {
+    FreePageIndices_.pop_back();
+  }
+  return page;
+}
+
+// Returns the memory of page index to the system and frees the index. The
+// caller has already taken the page off PageList_ and its blocks off
+// FreeList_, and drops it from PageSpans_ afterwards.
+void ObjectAllocator::release_page(unsigned index)
+{
+  char* page;
+  unsigned blocks;
+
+  page = reinterpret_cast<char*>(Pages_[index]);
+  blocks = page_blocks(Pages_[index]);
+
+  // Remember how far the use counters got, so handles into this page stay
+  // stale once the index is reused
+  if (HBlockInfo_.type_ == OAConfig::hbExtended)
+  {
+    unsigned short epoch;
+    unsigned short furthest;
+
+    if (index >= PageEpochs_.size())
+    {
+      PageEpochs_.resize(Pages_.size(), 0);
+    }
+    epoch = PageEpochs_[index];
+    furthest = 0;
+    for (unsigned i = 0; i < blocks; ++i)
+    {
+      unsigned short usecount;
+      unsigned short advanced;
+
+      std::memcpy(&usecount, slot_block(Pages_[index], i) - PadBytes_ - HBlockInfo_.size_ + EXTENDED_USE_COUNT,
+        sizeof(usecount));
+      advanced = static_cast<unsigned short>(usecount - epoch);
+      furthest = advanced > furthest ? advanced : furthest;
+    }
+    PageEpochs_[index] = static_cast<unsigned short>(epoch + furthest);
+  }
+
+  if (FreeListType_ != OAConfig::flIntrusive)
+  {
+    unlink_available(Pages_[index]);
+    if (reinterpret_cast<PageHeader*>(page)->FreeCount == blocks)
+    {
+      EmptyPageBlocks_ -= blocks;
+    }
+  }
+
+  if (Region_)
+  {
+    if (!BufferRegion_)
+    {
+      OAVirtualMemory::Decommit(page, page_bytes(blocks));
+    }
+  }
+  else
+  {
+    free_page_memory(page, page_bytes(blocks));
+  }
+
+  FreeObjects_ -= blocks;
+  Pages_[index] = nullptr;
+  FreePageIndices_.push_back(index);
+  --PagesInUse_;
+}
+
+// Gives a page allocated by acquire_page (outside a reserved range) back
+void ObjectAllocator::free_page_memory(char* page, size_t bytes)
+{
+  PageSource_->Release(page, bytes, PAGE_ALIGNMENT);
+}
+
+// Frees the empty pages and, when relocating, as many of the sparsest pages
+// as the free blocks on the remaining pages can absorb. Returns pages freed.
+unsigned ObjectAllocator::release_sparse_pages(bool relocate, RELOCATECALLBACK fn, void* context)
+{
+  // Real-time pools keep every page they were built with
+  if (UseCPPMemManager_ || !PageList_ || RealTime_)
+  {
+    return 0;
+  }
+
+  typedef std::pair<std::uintptr_t, unsigned> PageSpan;
+  std::vector<PageSpan> spans;
+  std::vector<unsigned> freecount(Pages_.size(), 0);
+
+  // Pages sorted by address, so each free block finds its page in O(log n)
+  for (unsigned i = 0; i < Pages_.size(); ++i)
+  {
+    if (Pages_[i])
+    {
+      spans.push_back(PageSpan(reinterpret_cast<std::uintptr_t>(Pages_[i]), i));
+    }
+  }
+  std::sort(spans.begin(), spans.end());
+
+  auto page_of = [&spans](const void* block)
+  {
+    std::vector<PageSpan>::const_iterator span;
+
+    span = std::upper_bound(spans.begin(), spans.end(),
+      PageSpan(reinterpret_cast<std::uintptr_t>(block), ~0u));
+    return (--span)->second;
+  };
+
+  if (FreeListType_ != OAConfig::flIntrusive)
+  {
+    for (unsigned i = 0; i < Pages_.size(); ++i)
+    {
+      if (Pages_[i])
+      {
+        freecount[i] = reinterpret_cast<PageHeader*>(Pages_[i])->FreeCount;
+      }
+    }
+  }
+  else
+  {
+    for (GenericObject* freewalker = FreeList_; freewalker; freewalker = freewalker->Next)
+    {
+      ++freecount[page_of(freewalker)];
+    }
+  }
+
+  // Pick the pages to empty, sparsest first. A page qualifies while its
+  // live blocks fit in the free blocks of the pages that stay.
+  std::vector<unsigned> order;
+  std::vector<char> source(Pages_.size(), 0);
+  unsigned capacity;
+  unsigned sources;
+
+  for (unsigned i = 0; i < spans.size(); ++i)
+  {
+    order.push_back(spans[i].second);
+  }
+  std::stable_sort(order.begin(), order.end(), [&](unsigned a, unsigned b)
+  {
+    return page_blocks(Pages_[a]) - freecount[a] < page_blocks(Pages_[b]) - freecount[b];
+  });
+
+  capacity = FreeObjects_;
+  sources = 0;
+  for (unsigned i = 0; i < order.size(); ++i)
+  {
+    unsigned live;
+    unsigned index;
+
+    index = order[i];
+    live = page_blocks(Pages_[index]) - freecount[index];
+    if (live && (!relocate || live + freecount[index] > capacity))
+    {
+      break;
+    }
+
+    capacity -= freecount[index] + live;
+    source[index] = 1;
+    ++sources;
+  }
+
+  if (!sources)
+  {
+    return 0;
+  }
+
+  // Keep the free blocks of the staying pages (in order) and note which
+  // blocks of the leaving pages are free
+  std::vector<unsigned> base(Pages_.size(), 0);
+  std::vector<char> isfree;
+  GenericObject* newfree;
+  GenericObject** tail;
+
+  for (unsigned i = 0; i < Pages_.size(); ++i)
+  {
+    if (source[i])
+    {
+      base[i] = static_cast<unsigned>(isfree.size());
+      isfree.resize(isfree.size() + page_blocks(Pages_[i]), 0);
+    }
+  }
+
+  newfree = nullptr;
+  tail = &newfree;
+  if (FreeListType_ != OAConfig::flIntrusive)
+  {
+    for (unsigned i = 0; i < Pages_.size(); ++i)
+    {
+      if (!source[i])
+      {
+        continue;
+      }
+
+      // Moves must not land on a leaving page
+      unlink_available(Pages_[i]);
+
+      if (FreeListType_ == OAConfig::flIndexStack)
+      {
+        for (unsigned j = 0; j < reinterpret_cast<PageHeader*>(Pages_[i])->FreeCount; ++j)
+        {
+          isfree[base[i] + read_link(page_stack(Pages_[i]) + j * LinkBytes_)] = 1;
+        }
+        continue;
+      }
+
+      for (unsigned slot = reinterpret_cast<PageHeader*>(Pages_[i])->FreeHead; slot != NoSlot_;
+        slot = read_link(slot_block(Pages_[i], slot)))
+      {
+        isfree[base[i] + slot] = 1;
+      }
+    }
+
+  }
+  else
+  {
+  for (GenericObject* freewalker = FreeList_; freewalker; freewalker = freewalker->Next)
+  {
+    unsigned index;
+
+    index = page_of(freewalker);
+    if (source[index])
+    {
+      size_t offset;
+
+      offset = reinterpret_cast<char*>(freewalker) - reinterpret_cast<char*>(Pages_[index])
+        - PageHeaderSize_ - HBlockInfo_.size_ - PadBytes_;
+      isfree[base[index] + offset / BlockSize_] = 1;
+    }
+    else
+    {
+      *tail = freewalker;
+      tail = &freewalker->Next;
+    }
+  }
+  *tail = nullptr;
+  FreeList_ = newfree;
+  }
+
+  // Move the live blocks
+  for (unsigned i = 0; i < Pages_.size(); ++i)
+  {
+    if (!source[i])
+    {
+      continue;
+    }
+
+    for (unsigned slot = 0; slot < page_blocks(Pages_[i]); ++slot)
+    {
+      char* from;
+      char* to;
+
+      if (isfree[base[i] + slot])
+      {
+        continue;
+      }
+
+      from = reinterpret_cast<char*>(Pages_[i]) + PageHeaderSize_ + HBlockInfo_.size_ + PadBytes_
+        + slot * BlockSize_;
+      to = pop_free_block();
+
+      move_block(from, to);
+      if (fn)
+      {
+        fn(from, to, ObjectSize_, context);
+      }
+    }
+  }
+
+  return release_marked_pages(source);
+}
+
+// Unlinks the marked pages from the page list and gives them back. Their
+// blocks must be off the free lists already (per-page lists unlink in
+// release_page). Returns the number of pages released.
+unsigned ObjectAllocator::release_marked_pages(const std::vector<char>& marked)
+{
+  typedef std::pair<std::uintptr_t, unsigned> MarkedPage;
+  std::vector<MarkedPage> pages;
+  GenericObject** pagelink;
+  unsigned released;
+
+  // The marked pages by address, so each page on the list is looked up in
+  // O(log n) instead of searched for its index
+  for (unsigned i = 0; i < marked.size(); ++i)
+  {
+    if (marked[i])
+    {
+      pages.push_back(MarkedPage(reinterpret_cast<std::uintptr_t>(Pages_[i]), i));
+    }
+  }
+  std::sort(pages.begin(), pages.end());
+
+  pagelink = &PageList_;
+  released = 0;
+  while (*pagelink && released < pages.size())
+  {
+    std::vector<MarkedPage>::const_iterator page;
+    std::uintptr_t address;
+
+    address = reinterpret_cast<std::uintptr_t>(*pagelink);
+    page = std::lower_bound(pages.begin(), pages.end(), MarkedPage(address, 0));
+    if (page != pages.end() && page->first == address)
+    {
+      *pagelink = (*pagelink)->Next;
+      release_page(page->second);
+      ++released;
+    }
+    else
+    {
+      pagelink = &(*pagelink)->Next;
+    }
+  }
+
+  // Drop the released pages from PageSpans_ in one pass
+  PageSpans_.erase(std::remove_if(PageSpans_.begin(), PageSpans_.end(),
+    [this](const std::pair<std::uintptr_t, unsigned>& span) { return !Pages_[span.second]; }),
+    PageSpans_.end());
+
+  return released;
+}
+
+// True if growing by bytes would take the cgroup within CgroupHeadroomPct_
+// of memory.max, or PSI says memory is under pressure. The files are read
+// at most every PRESSURE_SAMPLE_MS; in between the last answer stands.
+bool ObjectAllocator::memory_tight(size_t bytes)
+{
+  OAPressure::Sample sample;
+  unsigned long long now;
+  unsigned long long interval;
+  unsigned long long headroom;
+
+  now = OAClock::Ticks();
+  interval = static_cast<unsigned long long>(OAClock::TicksPerSecond() * PRESSURE_SAMPLE_MS / 1000.0);
+  if (PressureSampled_ && now >= PressureSampledAt_ && now - PressureSampledAt_ < interval)
+  {
+    return MemoryTight_;
+  }
+
+  PressureSampled_ = true;
+  PressureSampledAt_ = now;
+  MemoryTight_ = false;
+  if (!OAPressure::Read(sample))
+  {
+    return MemoryTight_;
+  }
+
+  if (sample.Limit)
+  {
+    headroom = sample.Limit / 100 * CgroupHeadroomPct_;
+    MemoryTight_ = sample.Usage + bytes + headroom > sample.Limit;
+  }
+  if (PressureAvg10_ > 0.0 && sample.SomeAvg10 >= PressureAvg10_)
+  {
+    MemoryTight_ = true;
+  }
+
+  return MemoryTight_;
+}
+
+// Moves a live block (header and object) into the free block at to. The
+// destination keeps counting its own uses.
+void ObjectAllocator::move_block(char* from, char* to)
+{
+  char* fromheader;
+  char* toheader;
+
+  fromheader = from - PadBytes_ - HBlockInfo_.size_;
+  toheader = to - PadBytes_ - HBlockInfo_.size_;
+
+  if (HBlockInfo_.type_ == OAConfig::hbExtended)
+  {
+    unsigned short usecount;
+
+    std::memcpy(&usecount, toheader + EXTENDED_USE_COUNT, sizeof(usecount));
+    std::memcpy(toheader, fromheader, HBlockInfo_.size_);
+    std::memcpy(toheader + EXTENDED_USE_COUNT, &usecount, sizeof(usecount));
+    bump_use_count(toheader);
+  }
+  else
+  {
+    // The external header's MemBlockInfo changes hands with the pointer
+    std::memcpy(toheader, fromheader, HBlockInfo_.size_);
+  }
+
+  std::memcpy(to, from, ObjectSize_);
+
+  if (Trace_)
+  {
+    Trace_->Record(TracePool_, OATraceRecorder::opFree, from, nullptr);
+    Trace_->Record(TracePool_, OATraceRecorder::opAllocate, to, nullptr);
+  }
+}
+
+// Grows the pool until it holds at least objects blocks or MaxPages_ is hit
+unsigned ObjectAllocator::reserve_pages(size_t objects, bool prefault)
+{
+  unsigned pages;
+
+  pages = 0;
+  if (UseCPPMemManager_)
+  {
+    return pages;
+  }
+
+  while (FreeObjects_ + ObjectsInUse_ < objects && (!MaxPages_ || PagesInUse_ < MaxPages_))
+  {
+    // Capacity asked for up front is no reason to be OOM-killed either
+    if (CgroupAware_ && memory_tight(page_bytes(NextPageBlocks_)))
+    {
+      fail(oaNoMemory, "Reserve: out of physical memory (cgroup memory limit or pressure)");
+      break;
+    }
+    if (!allocate_new_page())
+    {
+      break;
+    }
+    ++pages;
 
-  return stats;
+    if (prefault)
+    {
+      prefault_page(reinterpret_cast<char*>(PageList_), page_bytes(page_blocks(PageList_)));
+    }
+  }
+
+  return pages;
 }
 
-void ObjectAllocator::allocate_new_page()
+// Touches every OS page so the first client writes don't fault
+void ObjectAllocator::prefault_page(char* page, size_t bytes)
 {
-  char* newpage;
+  volatile char* touch;
 
-  try
+  touch = page;
+  for (size_t i = 0; i < bytes; i += PREFAULT_STRIDE)
   {
-    // If new throws an exception, catch it, and throw our own type of exception
-    newpage = new char[PageSize_];
+    touch[i] = touch[i];
   }
-  catch (std::bad_alloc &)
+  touch[bytes - 1] = touch[bytes - 1];
+}
+
+// Releases every page back to the system
+void ObjectAllocator::free_pages()
+{
+  GenericObject* pagewalker;
+  GenericObject* nextpage;
+
+  pagewalker = PageList_;
+  nextpage = nullptr;
+  PageList_ = nullptr;
+  FreeList_ = nullptr;
+  for (unsigned i = 0; i < OCCUPANCY_BUCKETS; ++i)
   {
-    throw OAException(OAException::E_NO_MEMORY, "allocate_new_page: No system memory available.");
+    Available_[i] = nullptr;
   }
-
-  // Fill in unallocated memory signature
-  for (unsigned i = 0; i < PageSize_; ++i)
+  EmptyPageBlocks_ = 0;
+  Pages_.clear();
+  FreePageIndices_.clear();
+  PageEpochs_.clear();
+  PageSpans_.clear();
+
+  // The pages of a reserved range go back with it
+  if (Region_)
   {
-    newpage[i] = UNALLOCATED_PATTERN;
+    if (!BufferRegion_)
+    {
+      OAVirtualMemory::Release(Region_, RegionSize_);
+    }
+    Region_ = nullptr;
+    return;
   }
 
-  // Fill in padding memory signature
-  if (PadBytes_)
+  // While a page left to delete, delete the page and walk to next page
+  while (pagewalker)
   {
-    char* padwalker;
-    char* pageend;
+    nextpage = pagewalker->Next;
 
-    padwalker = newpage + sizeof(GenericObject*) + HBlockInfo_.size_;
-    pageend = newpage + PageSize_;
+    free_page_memory(reinterpret_cast<char*>(pagewalker), page_bytes(page_blocks(pagewalker)));
 
-    while (true)
-    {
-      for (unsigned i = 0; i < PadBytes_; ++i)
-      {
-        padwalker[i] = PAD_PATTERN;
-      }
+    pagewalker = nextpage;
+  }
+}
 
-      padwalker += PadBytes_ + ObjectSize_;
+// Takes the next free block off the free list (there must be one)
+char* ObjectAllocator::pop_free_block()
+{
+  char* block;
 
-      if (padwalker >= pageend)
-      {
-        break;
-      }
+  if (FreeListType_ != OAConfig::flIntrusive)
+  {
+    GenericObject* page;
+    PageHeader* header;
 
-      for (unsigned i = 0; i < PadBytes_; ++i)
-      {
-        padwalker[i] = PAD_PATTERN;
-      }
+    page = first_available();
+    header = reinterpret_cast<PageHeader*>(page);
 
-      padwalker += PadBytes_ + HBlockInfo_.size_;
+    if (FreeListType_ == OAConfig::flCompressed)
+    {
+      block = slot_block(page, header->FreeHead);
+      header->FreeHead = read_link(block);
+    }
+    else
+    {
+      block = slot_block(page, read_link(page_stack(page) + (header->FreeCount - 1) * LinkBytes_));
+    }
 
-      if (padwalker >= pageend)
-      {
-        break;
-      }
+    if (header->FreeCount == header->Blocks)
+    {
+      EmptyPageBlocks_ -= header->Blocks;
     }
+    --header->FreeCount;
+    update_available(page);
+
+    return block;
   }
 
-  // Fill in header memory signature
-  if (HBlockInfo_.size_)
+  block = reinterpret_cast<char*>(FreeList_);
+  FreeList_ = FreeList_->Next;
+  return block;
+}
+
+// Puts block at the front of its free list
+void ObjectAllocator::push_free_block(char* block)
+{
+  if (FreeListType_ != OAConfig::flIntrusive)
   {
-    char* headerwalker;
-    char* pageend;
+    GenericObject* page;
+    PageHeader* header;
 
-    headerwalker = newpage + sizeof(GenericObject*);
-    pageend = newpage + PageSize_;
+    page = find_page(block);
+    header = reinterpret_cast<PageHeader*>(page);
 
-    while (headerwalker < pageend)
+    if (FreeListType_ == OAConfig::flCompressed)
     {
-      #define HEADER_PATTERN 0x00
+      write_link(block, header->FreeHead);
+      header->FreeHead = block_slot(page, block);
+    }
+    else
+    {
+      write_link(page_stack(page) + header->FreeCount * LinkBytes_, block_slot(page, block));
+    }
 
-      for (unsigned i = 0; i < HBlockInfo_.size_; ++i)
+    ++header->FreeCount;
+    if (header->FreeCount == header->Blocks)
+    {
+      EmptyPageBlocks_ += header->Blocks;
+      if (ScavengeIntervalMs_)
       {
-        headerwalker[i] = HEADER_PATTERN;
+        header->EmptySince = OAClock::Ticks();
       }
+    }
+    update_available(page);
+    return;
+  }
 
-      headerwalker += HBlockInfo_.size_ + 2 * PadBytes_ + ObjectSize_;
+  GenericObject* castedblock;
+
+  castedblock = reinterpret_cast<GenericObject*>(block);
+  castedblock->Next = FreeList_;
+  FreeList_ = castedblock;
+}
+
+// Page to allocate from: the head of the fullest non-empty bucket
+GenericObject* ObjectAllocator::first_available() const
+{
+  for (unsigned i = Buckets_; i > 0; --i)
+  {
+    if (Available_[i - 1])
+    {
+      return Available_[i - 1];
     }
   }
 
-  GenericObject* castedpage;
+  return nullptr;
+}
 
-  castedpage = reinterpret_cast<GenericObject*>(newpage);
+// Files page under the bucket for its occupancy (none once it is full)
+void ObjectAllocator::update_available(GenericObject* page)
+{
+  PageHeader* header;
+  unsigned bucket;
 
-  // Link the page list
-  GenericObject* nextpage = PageList_;
-  PageList_ = castedpage;
-  PageList_->Next = nextpage;
+  header = reinterpret_cast<PageHeader*>(page);
+  bucket = ~0u;
+  if (header->FreeCount)
+  {
+    bucket = static_cast<unsigned>(static_cast<unsigned long long>(header->Blocks - header->FreeCount)
+      * Buckets_ / header->Blocks);
+  }
 
-  // Link free list
-  // todo: handle allignments
-  char* placeholder;
-  GenericObject* freelistwalker;
+  if (bucket == header->Bucket)
+  {
+    return;
+  }
 
-  placeholder = newpage + sizeof(GenericObject*) + HBlockInfo_.size_
-  + PadBytes_
-  ;
-  freelistwalker = reinterpret_cast<GenericObject*>(placeholder);
-  FreeList_ = freelistwalker;
-  FreeList_->Next = nullptr;
+  unlink_available(page);
+  if (bucket != ~0u)
+  {
+    header->Bucket = bucket;
+    header->PrevAvailable = nullptr;
+    header->NextAvailable = Available_[bucket];
+    if (Available_[bucket])
+    {
+      reinterpret_cast<PageHeader*>(Available_[bucket])->PrevAvailable = page;
+    }
+    Available_[bucket] = page;
+  }
+}
+
+void ObjectAllocator::unlink_available(GenericObject* page)
+{
+  PageHeader* header;
 
-  for (unsigned i = 0; i < ObjectsPerPage_ - 1; ++i)
+  header = reinterpret_cast<PageHeader*>(page);
+  if (header->Bucket == ~0u)
   {
-    placeholder += ObjectSize_ + (2 * PadBytes_) + HBlockInfo_.size_;
-    freelistwalker = reinterpret_cast<GenericObject*>(placeholder);
-    freelistwalker->Next = FreeList_;
-    FreeList_ = freelistwalker;
+    return;
   }
 
-  // Handle private stats
-  ++PagesInUse_;
-  for (unsigned i = 0; i < ObjectsPerPage_; ++i)
+  if (header->PrevAvailable)
+  {
+    reinterpret_cast<PageHeader*>(header->PrevAvailable)->NextAvailable = header->NextAvailable;
+  }
+  else
   {
-    ++FreeObjects_;
+    Available_[header->Bucket] = header->NextAvailable;
   }
+  if (header->NextAvailable)
+  {
+    reinterpret_cast<PageHeader*>(header->NextAvailable)->PrevAvailable = header->PrevAvailable;
+  }
+
+  header->Bucket = ~0u;
 }
 
-void ObjectAllocator::put_on_freelist(void* Object)
+// Block at slot of page
+char* ObjectAllocator::slot_block(GenericObject* page, unsigned slot) const
 {
-  objtmp_ = Object;
+  return reinterpret_cast<char*>(page) + PageHeaderSize_ + HBlockInfo_.size_ + PadBytes_
+    + slot * BlockSize_;
+}
+
+// Slot of block on page
+unsigned ObjectAllocator::block_slot(const GenericObject* page, const char* block) const
+{
+  return static_cast<unsigned>((block - reinterpret_cast<const char*>(page)
+    - PageHeaderSize_ - HBlockInfo_.size_ - PadBytes_) / BlockSize_);
 }
 
-ObjectAllocator::ObjectAllocator(const ObjectAllocator& oa)
+// Index stack of a page (the bytes after its last block)
+char* ObjectAllocator::page_stack(GenericObject* page) const
 {
-  const ObjectAllocator tmp = oa;
+  return reinterpret_cast<char*>(page) + PageHeaderSize_ + page_blocks(page) * BlockSize_;
 }
 
-ObjectAllocator& ObjectAllocator::operator=(const ObjectAllocator& oa)
+// Compressed links and index stack entries are LinkBytes_ little-endian bytes
+unsigned ObjectAllocator::read_link(const char* block) const
 {
-  const ObjectAllocator tmp = oa;
-  return *this;
+  unsigned slot;
+
+  slot = 0;
+  for (unsigned i = 0; i < LinkBytes_; ++i)
+  {
+    slot |= static_cast<unsigned>(static_cast<unsigned char>(block[i])) << (8 * i);
+  }
+  return slot;
+}
+
+void ObjectAllocator::write_link(char* block, unsigned slot)
+{
+  for (unsigned i = 0; i < LinkBytes_; ++i)
+  {
+    block[i] = static_cast<char>(slot >> (8 * i));
+  }
+}
+
+void ObjectAllocator::put_on_freelist(void* Object)
+{
+  objtmp_ = Object;
 }
 
 // Make sure this object hasn't been freed yet
 // todo: make it constant time
 bool ObjectAllocator::IsOnFreeList(GenericObject * object) const
 {
+  // Real-time: the block's flag instead of a walk
+  if (RealTime_)
+  {
+    unsigned page;
+    unsigned slot;
+
+    return locate(object, page, slot) && !InUse_[static_cast<size_t>(page) * ObjectsPerPage_ + slot];
+  }
+
+  // Compressed links: only the object's own page can hold it
+  if (FreeListType_ == OAConfig::flCompressed)
+  {
+    GenericObject* page;
+
+    page = find_page(object);
+    if (!page)
+    {
+      return false;
+    }
+
+    for (unsigned slot = reinterpret_cast<PageHeader*>(page)->FreeHead; slot != NoSlot_;
+      slot = read_link(slot_block(page, slot)))
+    {
+      if (slot_block(page, slot) == reinterpret_cast<char*>(object))
+      {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  // Index stack: scan the page's stack
+  if (FreeListType_ == OAConfig::flIndexStack)
+  {
+    GenericObject* page;
+    char* stack;
+    unsigned count;
+
+    page = find_page(object);
+    if (!page)
+    {
+      return false;
+    }
+
+    stack = page_stack(page);
+    count = reinterpret_cast<PageHeader*>(page)->FreeCount;
+    for (unsigned i = 0; i < count; ++i)
+    {
+      if (slot_block(page, read_link(stack + i * LinkBytes_)) == reinterpret_cast<char*>(object))
+      {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
   GenericObject* freelistwalker;
   freelistwalker = FreeList_;
     
@@ -495,46 +2331,144 @@ bool ObjectAllocator::IsOnFreeList(GenericObject * object) const
 // Make sure this object is not on bad boundary
 bool ObjectAllocator::IsOnBadBoundary(GenericObject * object) const
 {
-  GenericObject* pagewalker;
-  char* pageend;
-  GenericObject* castedpageend;
+  GenericObject* page;
   char* firstobjpos;
-  //char* lastobjpos;
-
-  pagewalker = PageList_;
+  char* pageend;
 
   // Check the page which the object is on
-  while (true)
+  page = find_page(object);
+  if (!page)
   {
-    pageend = reinterpret_cast<char*>(pagewalker) + PageSize_;
-    castedpageend = reinterpret_cast<GenericObject*>(pageend);
-
-    firstobjpos = reinterpret_cast<char*>(pagewalker) + sizeof(GenericObject*)
-    + PadBytes_
-    + HBlockInfo_.size_
-    ;
+    return true;
+  }
 
-    // If the object is in a page
-    if (reinterpret_cast<GenericObject*>(firstobjpos) <= object &&
-      object < castedpageend
-      )
-    {
-      break;
-    }
+  firstobjpos = reinterpret_cast<char*>(page) + PageHeaderSize_
+  + PadBytes_
+  + HBlockInfo_.size_
+  ;
+  pageend = reinterpret_cast<char*>(page) + PageHeaderSize_ + page_blocks(page) * BlockSize_;
 
-    // If the object is not in a page
-    pagewalker = pagewalker->Next;
-    if (!pagewalker)
-    {
-      return true;
-    }
+  // The object is in the page's header or the first block's header/pad
+  if (reinterpret_cast<char*>(object) < firstobjpos || reinterpret_cast<char*>(object) >= pageend)
+  {
+    return true;
   }
 
   // The object in between
   size_t disttoobj;
 
   disttoobj = reinterpret_cast<char*>(object) - firstobjpos;
-  return (disttoobj % (ObjectSize_ + 2 * PadBytes_ + HBlockInfo_.size_)) != 0;
+  return (disttoobj % BlockSize_) != 0;
+}
+
+// Page that holds object, or null if it lies on no page
+GenericObject* ObjectAllocator::find_page(const void* object) const
+{
+  unsigned index;
+
+  if (!page_index(object, index))
+  {
+    return nullptr;
+  }
+
+  return Pages_[index];
+}
+
+// Index into Pages_ of the page that holds object (O(1) with a reserved
+// range, a binary search of PageSpans_ otherwise)
+bool ObjectAllocator::page_index(const void* object, unsigned& index) const
+{
+  std::uintptr_t address;
+
+  address = reinterpret_cast<std::uintptr_t>(object);
+
+  // Reserved range: pages are PageStride_ apart from Region_
+  if (Region_)
+  {
+    std::uintptr_t base;
+
+    base = reinterpret_cast<std::uintptr_t>(Region_);
+    if (address < base || address - base >= Pages_.size() * PageStride_)
+    {
+      return false;
+    }
+
+    index = static_cast<unsigned>((address - base) / PageStride_);
+    return Pages_[index] != nullptr;
+  }
+
+  // Otherwise the last page starting at or below address
+  std::vector<std::pair<std::uintptr_t, unsigned> >::const_iterator span;
+
+  span = std::upper_bound(PageSpans_.begin(), PageSpans_.end(), std::make_pair(address, ~0u));
+  if (span == PageSpans_.begin())
+  {
+    return false;
+  }
+
+  --span;
+  index = span->second;
+  return address < span->first + page_bytes(page_blocks(Pages_[index]));
+}
+
+// Page index and slot of the block at object (O(1) for a reserved range)
+bool ObjectAllocator::locate(const void* object, unsigned& page, unsigned& slot) const
+{
+  std::uintptr_t address;
+  std::uintptr_t first;
+  unsigned index;
+
+  address = reinterpret_cast<std::uintptr_t>(object);
+  if (!page_index(object, index))
+  {
+    return false;
+  }
+
+  first = reinterpret_cast<std::uintptr_t>(Pages_[index]) + PageHeaderSize_ + HBlockInfo_.size_ + PadBytes_;
+  if (address < first || (address - first) % BlockSize_)
+  {
+    return false;
+  }
+
+  page = index;
+  slot = static_cast<unsigned>((address - first) / BlockSize_);
+  return slot < page_blocks(Pages_[index]);
+}
+
+// Real-time: marks the block at object (a known block boundary) in use or free
+void ObjectAllocator::set_in_use(const void* object, unsigned char state)
+{
+  unsigned page;
+  unsigned slot;
+
+  locate(object, page, slot);
+  InUse_[static_cast<size_t>(page) * ObjectsPerPage_ + slot] = state;
+}
+
+// Number of blocks carved from a page
+unsigned ObjectAllocator::page_blocks(const GenericObject* page) const
+{
+  if (PageInfo_)
+  {
+    return reinterpret_cast<const PageHeader*>(page)->Blocks;
+  }
+
+  return ObjectsPerPage_;
+}
+
+// Size of a page holding the given number of blocks
+size_t ObjectAllocator::page_bytes(unsigned blocks) const
+{
+  size_t stack;
+
+  // The index stack follows the blocks, rounded up to a pointer
+  stack = 0;
+  if (FreeListType_ == OAConfig::flIndexStack)
+  {
+    stack = (blocks * LinkBytes_ + sizeof(GenericObject*) - 1) / sizeof(GenericObject*) * sizeof(GenericObject*);
+  }
+
+  return PageHeaderSize_ + blocks * BlockSize_ + stack;
 }
 
 // Make sure this object does not have corrupted block
@@ -565,49 +2499,68 @@ bool ObjectAllocator::HasCorruptedBlock(void * object) const
   return false;
 }
 
-// by-pass the functionality of the OA and use new/delete
+// by-pass the functionality of the OA and use new/delete. The object
+// follows a CPPBlock header (a whole number of max_align_t, so it keeps
+// new's alignment) that links it onto CPPBlocks_.
 void * ObjectAllocator::CPPMemManagerAlloc()
 {
-  char* object;
-  object = new char[sizeof(ObjectSize_)];
+  char* memory;
+  CPPBlock* block;
 
-  GenericObject* castedobj;
-  castedobj = reinterpret_cast<GenericObject*>(object);
-  castedobj->Next = nullptr;
-
-  if (!PageList_)
+  memory = new (std::nothrow) char[CPP_BLOCK_SIZE + ObjectSize_];
+  if (!memory)
   {
-    PageList_ = castedobj;
+    fail(oaNoMemory, "CPPMemManagerAlloc: No system memory available.");
+    return nullptr;
   }
-  else
+
+  // Push on the front of the live list
+  block = reinterpret_cast<CPPBlock*>(memory);
+  block->Prev = nullptr;
+  block->Next = CPPBlocks_;
+  if (CPPBlocks_)
   {
-    GenericObject* pagewalker;
-    pagewalker = PageList_;
-    while (pagewalker->Next)
-    {
-      pagewalker = pagewalker->Next;
-    }
-    pagewalker->Next = castedobj;
+    CPPBlocks_->Prev = block;
   }
+  CPPBlocks_ = block;
 
-  return castedobj;
+  return memory + CPP_BLOCK_SIZE;
 }
 
 void ObjectAllocator::CPPMemManagerFree(GenericObject * object)
 {
-  GenericObject* pagewalker;
-  pagewalker = PageList_;
-  while (pagewalker->Next != object)
+  CPPBlock* block;
+
+  block = reinterpret_cast<CPPBlock*>(reinterpret_cast<char*>(object) - CPP_BLOCK_SIZE);
+
+  // Unlink from the live list
+  if (block->Prev)
+  {
+    block->Prev->Next = block->Next;
+  }
+  else
+  {
+    CPPBlocks_ = block->Next;
+  }
+  if (block->Next)
   {
-    pagewalker = pagewalker->Next;
+    block->Next->Prev = block->Prev;
   }
 
-  GenericObject* objtodel;
-  objtodel = pagewalker->Next;
-  pagewalker->Next = objtodel->Next;
+  delete[] reinterpret_cast<char*>(block);
+}
+
+// Deletes whatever pass-through objects the client never freed
+void ObjectAllocator::CPPMemManagerFreeAll()
+{
+  while (CPPBlocks_)
+  {
+    CPPBlock* next;
 
-  delete objtodel;
-  objtodel = nullptr;
+    next = CPPBlocks_->Next;
+    delete[] reinterpret_cast<char*>(CPPBlocks_);
+    CPPBlocks_ = next;
+  }
 }
 
   //GenericObject* content;
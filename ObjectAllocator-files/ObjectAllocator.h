@@ -3,12 +3,46 @@
 #define OBJECTALLOCATORH
 //---------------------------------------------------------------------------
 
+#include <cstdint>
+#include <deque>
+#include <mutex>
 #include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 // #include <iostream>
+#include "OAHistogram.h"
+
+// Exceptions are on unless the compiler was told otherwise (-fno-exceptions,
+// /EHs-c-). Without them the throwing calls print the error and abort;
+// TryAllocate/TryFree work the same either way.
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS) || defined(_CPPUNWIND)
+#define OA_EXCEPTIONS 1
+#else
+#define OA_EXCEPTIONS 0
+#endif
+
+// C++20 coroutine support (AllocateAsync, see OACoroutine.h)
+#if defined(__cpp_impl_coroutine)
+#define OA_COROUTINES 1
+#else
+#define OA_COROUTINES 0
+#endif
+
+#if OA_COROUTINES
+class OAExecutor;
+class OAAllocateAwaiter;
+#endif
 
 // If the client doesn't specify these:
 static const int DEFAULT_OBJECTS_PER_PAGE = 4;
 static const int DEFAULT_MAX_PAGES = 3;
+static const int DEFAULT_MAX_OBJECTS_PER_PAGE = 65536;
+
+class ObjectAllocator;
+class OATraceRecorder;
+class OAScavenger;
+class OAPageSource;
 
 class OAException
 {
@@ -40,6 +74,10 @@ private:
   std::string message_;
 };
 
+// Throws OAException(code, message), or without exceptions reports it and
+// aborts. Kept out of line so callers' fast paths don't build exceptions.
+[[noreturn]] void OARaise(OAException::OA_EXCEPTION code, const char *message);
+
 // ObjectAllocator configuration parameters
 struct OAConfig
 {
@@ -47,6 +85,10 @@ struct OAConfig
   static const size_t EXTERNAL_HEADER_SIZE = sizeof(void*);     // just a pointer
 
   enum HBLOCK_TYPE { hbNone, hbBasic, hbExtended, hbExternal };
+  enum GROWTH_POLICY { gpFixed, gpGeometric };
+  enum FREELIST_TYPE { flAuto, flIntrusive, flCompressed, flIndexStack };
+  enum ALLOC_POLICY { apLastFreed, apFullestPage };
+  enum OVERFLOW_MODE { ofNone, ofHeap, ofPool };
   struct HeaderBlockInfo
   {
     HBLOCK_TYPE type_;
@@ -81,6 +123,27 @@ struct OAConfig
     HBlockInfo_ = HBInfo;
     LeftAlignSize_ = 0;
     InterAlignSize_ = 0;
+    LatencyStats_ = false;
+    TraceRecorder_ = nullptr;
+    GrowthPolicy_ = gpFixed;
+    MaxObjectsPerPage_ = DEFAULT_MAX_OBJECTS_PER_PAGE;
+    ReserveObjects_ = 0;
+    PrefaultPages_ = false;
+    ReserveAddressSpace_ = false;
+    FreeListType_ = flAuto;
+    AllocPolicy_ = apLastFreed;
+    ScavengeIntervalMs_ = 0;
+    ScavengeSparePages_ = 1;
+    ScavengeDecayMs_ = 1000;
+    CgroupAware_ = false;
+    CgroupHeadroomPct_ = 10;
+    PressureAvg10_ = 10.0;
+    OverflowMode_ = ofNone;
+    OverflowPool_ = nullptr;
+    Waitable_ = false;
+    UsePageCache_ = false;
+    PageSource_ = nullptr;
+    RealTime_ = false;
   }
 
   bool UseCPPMemManager_;   // by-pass the functionality of the OA and use new/delete
@@ -93,13 +156,58 @@ struct OAConfig
 
   unsigned LeftAlignSize_;  // number of alignment bytes required to align first block
   unsigned InterAlignSize_; // number of alignment bytes required between remaining blocks
+
+  bool LatencyStats_;       // keep latency histograms for Allocate/Free/page growth
+  OATraceRecorder *TraceRecorder_; // records every Allocate/Free/new page (0=off)
+  GROWTH_POLICY GrowthPolicy_;  // gpGeometric: each new page doubles the previous one
+  unsigned MaxObjectsPerPage_;  // cap on blocks per page for geometric growth
+  size_t ReserveObjects_;   // capacity to pre-populate at construction (e.g. last run's MostObjects_)
+  bool PrefaultPages_;      // touch reserved pages so they are resident up front
+  bool ReserveAddressSpace_; // reserve MaxPages_ contiguous pages of address space up front
+                             // and commit them on demand (needs MaxPages_, fixed growth)
+  FREELIST_TYPE FreeListType_; // flCompressed: free blocks link by 8/16/32-bit slot number
+                               // within their page (flAuto: when objects are smaller than a pointer)
+                               // flIndexStack: free slot numbers live in a stack at the end of
+                               // each page; free blocks are never read or (unless DebugOn_) written
+  ALLOC_POLICY AllocPolicy_;   // apFullestPage: allocate from the fullest page that has room, so
+                               // sparse pages drain (needs per-page free lists: an intrusive
+                               // FreeListType_ becomes flIndexStack)
+  unsigned ScavengeIntervalMs_; // run a scavenger thread this often (0=none); it frees
+                                // empty pages beyond ScavengeSparePages_ that have been
+                                // empty for ScavengeDecayMs_. Makes the allocator lock
+                                // around every call and needs per-page free lists (an
+                                // intrusive FreeListType_ becomes flIndexStack)
+  unsigned ScavengeSparePages_; // empty pages the scavenger always keeps
+  unsigned ScavengeDecayMs_;    // how long a page stays empty before it can go
+  bool CgroupAware_;            // watch the cgroup memory limit and PSI: refuse new
+                                // pages (E_NO_MEMORY) when tight, and let the scavenger
+                                // (started if need be) free every empty page then
+  unsigned CgroupHeadroomPct_;  // tight when usage + a page is within this % of memory.max
+  double PressureAvg10_;        // tight when PSI "some" avg10 reaches this % (0=ignore PSI)
+  OVERFLOW_MODE OverflowMode_;  // once MaxPages_ is reached, serve allocations from new
+                                // (ofHeap) or OverflowPool_ (ofPool) instead of throwing E_NO_PAGES
+  ObjectAllocator *OverflowPool_; // ofPool: shared pool for the excess (not owned; its objects
+                                  // must be at least as big, and callers serialize access)
+  bool Waitable_;               // allow AllocateWait: every call takes a lock, and Free
+                                // hands its block straight to the longest waiting thread
+  bool UsePageCache_;           // take pages from and return them to the process-wide
+                                // OAPageCache (not with ReserveAddressSpace_)
+  OAPageSource *PageSource_;    // where pages come from (not owned; 0=new[], or the
+                                // OAPageCache with UsePageCache_; not with ReserveAddressSpace_)
+  bool RealTime_;               // bounded worst case: all MaxPages_ pages are built in a reserved
+                                // range (or the caller's buffer), prefaulted and locked in memory
+                                // at construction. After that Allocate/Free make no system or heap
+                                // calls and every check is fixed-cost (use TryAllocate/TryFree: a
+                                // thrown exception builds a string). No growth, trimming, tracing,
+                                // scavenger, overflow, pass-through, locking or external headers.
 };
 
 // ObjectAllocator statistical info
 struct OAStats
 {
   OAStats(void) : ObjectSize_(0), PageSize_(0), FreeObjects_(0), ObjectsInUse_(0), PagesInUse_(0),
-    MostObjects_(0), Allocations_(0), Deallocations_(0) {};
+    MostObjects_(0), Allocations_(0), Deallocations_(0), Fragmentation_(0.0),
+    OverflowInUse_(0), OverflowAllocations_(0) {};
 
   size_t ObjectSize_;      // size of each object
   size_t PageSize_;        // size of a page including all headers, padding, etc.
@@ -109,6 +217,10 @@ struct OAStats
   unsigned MostObjects_;   // most objects in use by client at one time
   unsigned Allocations_;   // total requests to allocate memory
   unsigned Deallocations_; // total requests to free memory
+  double Fragmentation_;   // free blocks on pages that also hold objects / all blocks
+                           // (these pages can't be freed; intrusive lists count every free block)
+  unsigned OverflowInUse_;       // objects in use that came from the overflow source
+  unsigned OverflowAllocations_; // total allocations served by the overflow source
 };
 
 // This allows us to easily treat raw objects as nodes in a linked list
@@ -117,6 +229,39 @@ struct GenericObject
   GenericObject *Next;
 };
 
+// Front of each page when pages carry their own bookkeeping (otherwise a
+// page starts with just the GenericObject link)
+struct PageHeader
+{
+  GenericObject *Next;  // page list link (must stay first)
+  unsigned Blocks;      // number of blocks carved from this page
+  unsigned FreeCount;   // compressed links/index stack: free blocks on this page
+  unsigned FreeHead;    // compressed links: slot of the first free block
+  GenericObject *NextAvailable; // compressed links/index stack: pages with free blocks
+  GenericObject *PrevAvailable; //   are doubly linked per occupancy bucket
+  unsigned Bucket;      // occupancy bucket the page is listed in (~0u = none)
+  unsigned long long EmptySince; // with a scavenger: OAClock ticks when it last emptied
+};
+
+// Front of each new/delete pass-through object; every live one is on a
+// doubly linked list so Free unlinks it in O(1)
+struct CPPBlock
+{
+  CPPBlock *Next;
+  CPPBlock *Prev;
+};
+
+// A caller queued for a block by AllocateWait/AllocateOrQueue. When a Free
+// makes room, the allocator allocates Block for the oldest waiter and calls
+// its Wake with the allocator lock held (so Wake must not call back in).
+struct OAWaiter
+{
+  const char *Label;               // label for the block
+  void *Block;                     // filled in before Wake is called
+  void (*Wake)(OAWaiter *waiter);
+  void *Context;                   // for Wake
+};
+
 struct MemBlockInfo
 {
   bool in_use;        // Is the block free or in use?
@@ -131,6 +276,8 @@ public:
   // Defined by the client (pointer to a block, size of block)
   typedef void(*DUMPCALLBACK)(const void *, size_t);
   typedef void(*VALIDATECALLBACK)(const void *, size_t);
+  // Defined by the client (old block, new block, size of block, Compact's context)
+  typedef void(*RELOCATECALLBACK)(const void *, void *, size_t, void *);
 
   // Predefined values for memory signatures
   static const unsigned char UNALLOCATED_PATTERN = 0xAA;
@@ -143,6 +290,19 @@ public:
   // Throws an exception if the construction fails. (Memory allocation problem)
   ObjectAllocator(size_t ObjectSize, const OAConfig& config);
 
+  // Carves every page from Buffer (BufferSize bytes, not owned; it must
+  // outlive the allocator) instead of the heap: no page is ever new'd, and
+  // E_NO_PAGES is thrown once the buffer is used up. MaxPages_ is capped at
+  // the pages that fit (0 = all of them) and growth is fixed. Page
+  // bookkeeping is sized here, so TryAllocate/TryFree never touch the heap
+  // afterwards (a thrown OAException still builds its message string).
+  // Everything that would is off: external headers are refused, and
+  // new/delete pass-through, the page cache, overflow (ofHeap and ofPool
+  // both track objects in a hash set), Waitable_ (a queue of waiters) and
+  // TraceRecorder_ (per-thread rings and labels) are ignored. A null Buffer
+  // is the constructor above.
+  ObjectAllocator(size_t ObjectSize, const OAConfig& config, void* Buffer, size_t BufferSize);
+
   // Destroys the ObjectManager (never throws)
   ~ObjectAllocator();
 
@@ -154,15 +314,92 @@ public:
   // Throws an exception if the the object can't be freed. (Invalid object)
   void Free(void *Object);
 
+  // Error codes of the non-throwing calls; apart from oaOK they match
+  // OAException::OA_EXCEPTION in order
+  enum OA_ERROR { oaOK, oaNoMemory, oaNoPages, oaBadBoundary, oaMultipleFree, oaCorruptedBlock };
+
+  // Allocate and Free without exceptions: TryAllocate returns null and
+  // TryFree the error code. LastError/LastErrorMessage describe the calling
+  // thread's most recent failure in this pool (oaOK if none), so threads
+  // sharing a pool each see their own. The checks are the same ones
+  // Allocate/Free make. Neither throws: a heap that runs out while the pool
+  // grows or tracks a block is oaNoMemory.
+  void *TryAllocate(const char *label = 0);
+  OA_ERROR TryFree(void *Object);
+  OA_ERROR LastError(void) const;
+  const char *LastErrorMessage(void) const;
+
+  // Allocate that waits up to TimeoutMs for a concurrent Free when the pool
+  // is at MaxPages_ (needs Waitable_; otherwise it tries once). Waiters are
+  // served in arrival order and each Free wakes one. Returns null on
+  // timeout or a failed try (LastError is oaNoPages); other failures throw
+  // like Allocate.
+  void *AllocateWait(unsigned TimeoutMs, const char *label = 0);
+
+  // Non-blocking form for event loops: returns a block, or null with
+  // waiter queued. Without Waitable_ it tries once and never queues (null
+  // with LastError oaNoPages). Label, Wake and Context must be set; the
+  // waiter must stay alive until woken.
+  void *AllocateOrQueue(OAWaiter &waiter);
+
+  // True if AllocateWait/AllocateOrQueue can park callers (Waitable_)
+  bool IsWaitable(void) const;
+
+#if OA_COROUTINES
+  // co_await pool.AllocateAsync(executor): suspends while the pool is at
+  // MaxPages_ and resumes on executor once a Free hands it a block. Without
+  // Waitable_ it never suspends and yields null when the pool is full.
+  OAAllocateAwaiter AllocateAsync(OAExecutor &executor, const char *label = 0);
+#endif
+
   // Calls the callback fn for each block still in use
   unsigned DumpMemoryInUse(DUMPCALLBACK fn) const;
 
   // Calls the callback fn for each block that is potentially corrupted
   unsigned ValidatePages(VALIDATECALLBACK fn) const;
 
+  // Allocates and initializes enough pages to hold objects blocks in total
+  // (optionally touching them so they are resident). Returns the number of
+  // pages added; throws E_NO_PAGES if MaxPages_ stops it short, or
+  // E_NO_MEMORY if memory does (with CgroupAware_, a cgroup near its limit
+  // or under pressure).
+  unsigned Reserve(size_t objects, bool prefault = false);
+
+  // Page index (position in the page table) and slot of the block at Object;
+  // false if Object is not a block boundary on one of the pages.
+  // O(1) with a reserved address range, else a walk of the pages.
+  bool Locate(const void *Object, unsigned &Page, unsigned &Slot) const;
+
+  // Block at a page index and slot (null if there is no such block)
+  void *BlockAt(unsigned Page, unsigned Slot) const;
+
+  // Times the block at Object has been handed out (the extended header's
+  // use counter), or 0 while it is free or without extended headers
+  unsigned UseCount(const void *Object) const;
+
+  // Gives the memory of runs of free blocks back to the OS (whole OS pages
+  // only; it reads as zeros afterwards). Needs the index stack free list,
+  // no pad bytes and no extended headers, otherwise does nothing. Returns
+  // the number of bytes discarded.
+  size_t DiscardFreeMemory(void);
+
   // Frees all empty pages (extra credit)
   unsigned FreeEmptyPages(void);
 
+  // One scavenger pass: frees the empty pages beyond ScavengeSparePages_
+  // that have been empty for ScavengeDecayMs_, oldest first, or all empty
+  // pages when CgroupAware_ finds memory tight. The scavenger thread calls
+  // this; without one it returns 0. Returns pages freed.
+  unsigned Scavenge(void);
+
+  // Moves the live blocks off the sparsest pages into free blocks of denser
+  // pages, then frees every page left empty. fn is called once per moved
+  // block, before the old block goes away, so the client can patch its
+  // references. It runs under the lock of a locked pool (scavenger or
+  // Waitable_), so it must not call back into this allocator. Returns the
+  // number of pages freed.
+  unsigned Compact(RELOCATECALLBACK fn, void *Context = 0);
+
   // Returns true if FreeEmptyPages and alignments are implemented
   static bool ImplementedExtraCredit(void);
 
@@ -173,15 +410,29 @@ public:
   OAConfig GetConfig(void) const;       // returns the configuration parameters
   OAStats GetStats(void) const;         // returns the statistics for the allocator
 
+  // Copies the latency histograms into Stats (false if LatencyStats_ is off).
+  // Both take the pool's lock if it has one; a pool without one is only
+  // safe to read from the thread that uses it.
+  bool GetLatencyStats(OALatencyStats &Stats) const;
+  // Clears the latency histograms
+  void ResetLatencyStats(void);
+
 private:
+  // Holds Lock_ across each handle operation (and Compact's callback runs
+  // under it), so it uses the unlocked helpers
+  friend class HandleAllocator;
+
   // Some "suggested" members (only a suggestion!)
   GenericObject *PageList_;           // the beginning of the list of pages
   GenericObject *FreeList_;           // the beginning of the list of objects
-  void allocate_new_page(void);       // allocates another page of objects
+  bool allocate_new_page(void);       // allocates another page of objects (false: see LastError)
+  bool reserve_page_index(void);      // room to add a page without allocating (false: oaNoMemory)
   void put_on_freelist(void *Object); // puts Object onto the free list
 
   size_t ObjectSize_;
   size_t PageSize_;
+  size_t PageStride_;        // pages of Region_ are this far apart (PageSize_ rounded
+                             // up to alignof(max_align_t))
   unsigned PadBytes_;
   unsigned ObjectsPerPage_;
   unsigned MaxPages_;
@@ -196,7 +447,61 @@ private:
   unsigned Deallocations_{}; // total requests to free memory
   unsigned MostObjects_{};   // most objects in use by client at one time
   bool UseCPPMemManager_;
-  bool tmp_;
+  CPPBlock *CPPBlocks_;      // live pass-through objects (UseCPPMemManager_)
+  OALatencyStats *Latency_;  // latency histograms (null unless LatencyStats_)
+  OATraceRecorder *Trace_;   // event recorder (null unless TraceRecorder_)
+  unsigned TracePool_;       // pool id assigned by the recorder
+  size_t BlockSize_;         // header + pads + object
+  size_t PageHeaderSize_;    // bytes before the first block of a page
+  bool PageInfo_;            // pages start with a PageHeader
+  OAConfig::GROWTH_POLICY GrowthPolicy_;
+  unsigned MaxObjectsPerPage_;
+  unsigned NextPageBlocks_;  // block count of the next page allocated
+  size_t ReserveObjects_;
+  bool PrefaultPages_;
+  char *Region_;             // reserved address range (null unless ReserveAddressSpace_)
+  size_t RegionSize_;        // bytes reserved
+  bool BufferRegion_;        // Region_ is the caller's buffer: never committed,
+                             // decommitted or released
+  std::vector<GenericObject*> Pages_; // pages by index (null once released);
+                                      // with a reserved range, index = slot in it
+  std::vector<unsigned> FreePageIndices_; // released indices, reused first
+  std::vector<unsigned short> PageEpochs_; // extended headers: use count a reused
+                                          // index starts its blocks at
+  std::vector<std::pair<std::uintptr_t, unsigned> > PageSpans_; // (address, index) of each
+                                          // page sorted by address (not kept with Region_)
+  OAConfig::FREELIST_TYPE FreeListType_;  // flIntrusive or flCompressed
+  unsigned LinkBytes_;       // width of a compressed link or index stack entry
+  unsigned NoSlot_;          // compressed link that ends a page's free chain
+  static const unsigned OCCUPANCY_BUCKETS = 8;
+  GenericObject* Available_[OCCUPANCY_BUCKETS]; // pages with free blocks by how full they
+                                                // are (apLastFreed uses bucket 0 only)
+  unsigned Buckets_;         // buckets in use
+  OAConfig::ALLOC_POLICY AllocPolicy_;
+  unsigned EmptyPageBlocks_; // blocks on pages with no objects (per-page free lists)
+  unsigned ScavengeIntervalMs_;
+  unsigned ScavengeSparePages_;
+  unsigned ScavengeDecayMs_;
+  bool CgroupAware_;
+  unsigned CgroupHeadroomPct_;
+  double PressureAvg10_;
+  unsigned long long PressureSampledAt_; // OAClock ticks of the last cgroup read
+  bool PressureSampled_;
+  bool MemoryTight_;         // result of the last sample
+  OAConfig::OVERFLOW_MODE OverflowMode_;
+  ObjectAllocator* OverflowPool_;
+  std::unordered_set<void*> Overflowed_; // live objects from the overflow source
+  unsigned OverflowAllocations_;
+  bool UsePageCache_;
+  OAPageSource* PageSource_; // memory for pages outside a reserved range
+  bool RealTime_;
+  std::vector<unsigned char> InUse_; // real-time: a flag per block, by
+                                     // page index * ObjectsPerPage_ + slot
+  std::mutex* Lock_;         // serializes public calls (null unless scavenger or Waitable_)
+  bool Waitable_;            // AllocateWait/AllocateOrQueue may park callers
+  std::deque<OAWaiter*> Waiters_; // AllocateWait callers, oldest first
+  OAScavenger* Scavenger_;   // background page release (null unless ScavengeIntervalMs_)
+  bool DebugOn_;
   void* objtmp_;
   
     // Make private to prevent copy construction and assignment
@@ -209,9 +514,55 @@ private:
   bool IsOnBadBoundary(GenericObject* object) const;
   // Make sure this object does not have corrupted block
   bool HasCorruptedBlock(void* object) const;
+  // Page geometry
+  unsigned page_blocks(const GenericObject* page) const;
+  size_t page_bytes(unsigned blocks) const;
+  // Page that holds object, or null (O(1) for a reserved range)
+  GenericObject* find_page(const void* object) const;
+  bool page_index(const void* object, unsigned& index) const;
+  bool locate(const void* object, unsigned& page, unsigned& slot) const;
+  unsigned use_count(const void* Object) const;
+  void* block_at(unsigned Page, unsigned Slot) const;
+  void* try_allocate(const char* label);
+  OA_ERROR try_free(void* Object);
+  void set_in_use(const void* object, unsigned char state);
+  // Page lifetime
+  char* acquire_page(size_t bytes, unsigned& index);
+  void release_page(unsigned index);
+  void free_page_memory(char* page, size_t bytes);
+  // Free block bookkeeping for either free list type
+  char* pop_free_block(void);
+  void push_free_block(char* block);
+  char* slot_block(GenericObject* page, unsigned slot) const;
+  unsigned block_slot(const GenericObject* page, const char* block) const;
+  char* page_stack(GenericObject* page) const;
+  GenericObject* first_available(void) const;
+  void update_available(GenericObject* page);
+  void unlink_available(GenericObject* page);
+  unsigned read_link(const char* block) const;
+  void write_link(char* block, unsigned slot);
+  unsigned release_sparse_pages(bool relocate, RELOCATECALLBACK fn, void* context);
+  unsigned release_marked_pages(const std::vector<char>& marked);
+  bool memory_tight(size_t bytes);
+  void move_block(char* from, char* to);
+  unsigned reserve_pages(size_t objects, bool prefault);
+  void prefault_page(char* page, size_t bytes);
+  void free_pages(void);
+  // Untimed, untraced bodies of Allocate and Free; failures go to fail()
+  void* allocate_object(const char* label);
+  OA_ERROR free_object(void* Object);
+  void* allocate_overflow(const char* label);
+  OA_ERROR free_overflow(void* Object);
+  OA_ERROR create_pages(const OAConfig& config, bool reserve);
+  OA_ERROR fail(OA_ERROR error, const char* message);
+  [[noreturn]] void raise_error(void) const;
+  void* allocate_or_queue(OAWaiter& waiter);
+  void* try_once(const char* label);
+  void hand_off(void);
   // by-pass the functionality of the OA and use new/delete
   void* CPPMemManagerAlloc();
   void CPPMemManagerFree(GenericObject* object);
+  void CPPMemManagerFreeAll();
 };
 
 #endif
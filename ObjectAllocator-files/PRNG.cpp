@@ -6,41 +6,46 @@
 /* number and carry packed within the same 32 bit integer.              */
 /************************************************************************/
 
+#include "PRNG.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PRNG_SSE2 1
+#endif
+
 namespace Digipen
 {
 
 namespace Utils
 {
 
-static unsigned int SEED_X = 521288629;
-static unsigned int SEED_Y = 362436069;
+/* Use any pair of non-equal numbers from this list for "a" and "b"
+    18000 18030 18273 18513 18879 19074 19098 19164 19215 19584
+    19599 19950 20088 20508 20544 20664 20814 20970 21153 21243
+    21423 21723 21954 22125 22188 22293 22860 22938 22965 22974
+    23109 23124 23163 23208 23508 23520 23553 23658 23865 24114
+    24219 24660 24699 24864 24948 25023 25308 25443 26004 26088
+    26154 26550 26679 26838 27183 27258 27753 27795 27810 27834
+    27960 28320 28380 28689 28710 28794 28854 28959 28980 29013
+    29379 29889 30135 30345 30459 30714 30903 30963 31059 31083
+*/
+static const uint32_t MWC_A = 18000;
+static const uint32_t MWC_B = 30903;
 
-unsigned rand(void)
-{
-  /* Use any pair of non-equal numbers from this list for "a" and "b"
-      18000 18030 18273 18513 18879 19074 19098 19164 19215 19584
-      19599 19950 20088 20508 20544 20664 20814 20970 21153 21243
-      21423 21723 21954 22125 22188 22293 22860 22938 22965 22974
-      23109 23124 23163 23208 23508 23520 23553 23658 23865 24114
-      24219 24660 24699 24864 24948 25023 25308 25443 26004 26088
-      26154 26550 26679 26838 27183 27258 27753 27795 27810 27834
-      27960 28320 28380 28689 28710 28794 28854 28959 28980 29013
-      29379 29889 30135 30345 30459 30714 30903 30963 31059 31083
-  */
-  static unsigned int a = 18000, b = 30903;
+static const uint32_t DEFAULT_SEED_X = 521288629;
+static const uint32_t DEFAULT_SEED_Y = 362436069;
 
-  SEED_X = a * (SEED_X & 65535) + (SEED_X >> 16);
-  SEED_Y = b * (SEED_Y & 65535) + (SEED_Y >> 16);
+// Each thread has its own generator, seeded with srand on that thread
+static thread_local PRNG Generator;
 
-  return ((SEED_X << 16) + (SEED_Y & 65535));
+unsigned rand(void)
+{
+  return Generator.Next();
 }
 
 void srand(unsigned seed1, unsigned seed2)
 {
-  if (seed1)
-    SEED_X = seed1;   /* use default seeds if parameter is 0 */
-  if (seed2)
-    SEED_Y = seed2;
+  Generator.Seed(seed1, seed2);   /* use default seeds if parameter is 0 */
 }
 
 int Random(int low, int high)
@@ -49,6 +54,225 @@ int Random(int low, int high)
   return r1 % (high - low + 1) + low;
 }
 
+// Murmur3 finalizer; spreads seeds into unrelated lane states
+static uint32_t mix32(uint32_t h)
+{
+  h ^= h >> 16;
+  h *= 0x85EBCA6Bu;
+  h ^= h >> 13;
+  h *= 0xC2B2AE35u;
+  h ^= h >> 16;
+  return h;
+}
+
+static inline uint32_t rotl(uint32_t x, int k)
+{
+  return (x << k) | (x >> (32 - k));
+}
+
+static inline uint32_t mwc_step(uint32_t &x, uint32_t &y)
+{
+  x = MWC_A * (x & 65535) + (x >> 16);
+  y = MWC_B * (y & 65535) + (y >> 16);
+
+  return ((x << 16) + (y & 65535));
+}
+
+static inline uint32_t xoshiro_step(uint32_t &s0, uint32_t &s1, uint32_t &s2, uint32_t &s3)
+{
+  uint32_t result = rotl(s1 * 5, 7) * 9;
+  uint32_t t = s1 << 9;
+
+  s2 ^= s0;
+  s3 ^= s1;
+  s1 ^= s2;
+  s0 ^= s3;
+  s2 ^= t;
+  s3 = rotl(s3, 11);
+
+  return result;
+}
+
+PRNG::PRNG(unsigned seed1, unsigned seed2, ENGINE engine)
+  : engine_(engine), x_(DEFAULT_SEED_X), y_(DEFAULT_SEED_Y)
+{
+  Seed(seed1, seed2);
+}
+
+void PRNG::Seed(unsigned seed1, unsigned seed2)
+{
+  if (seed1)
+    x_ = seed1;
+  if (seed2)
+    y_ = seed2;
+
+  // xoshiro must not start from the all-zero state; mix32 of distinct
+  // inputs can't make all four words zero
+  s_[0] = mix32(x_);
+  s_[1] = mix32(y_ ^ 0x9E3779B9u);
+  s_[2] = mix32(x_ + 0x7F4A7C15u);
+  s_[3] = mix32(y_ + 0xF39CC060u);
+
+  seed_lanes();
+}
+
+void PRNG::seed_lanes(void)
+{
+  for (unsigned lane = 0; lane < LANES; ++lane)
+  {
+    uint32_t salt = mix32(lane * 2 + 1);
+
+    for (unsigned word = 0; word < 4; ++word)
+    {
+      uint32_t seed = word % 2 ? y_ : x_;
+      lanes_[word][lane] = mix32(seed ^ salt ^ mix32(word + 0x632BE5ABu));
+    }
+
+    // A zero MWC state never leaves zero
+    if (!lanes_[0][lane])
+      lanes_[0][lane] = DEFAULT_SEED_X;
+    if (!lanes_[1][lane])
+      lanes_[1][lane] = DEFAULT_SEED_Y;
+  }
+}
+
+uint32_t PRNG::Next(void)
+{
+  if (engine_ == MWC)
+    return mwc_step(x_, y_);
+
+  return xoshiro_step(s_[0], s_[1], s_[2], s_[3]);
+}
+
+// Lemire's multiply-shift reduction; the retry loop only runs for the
+// bound-dependent sliver of values that would otherwise bias the result
+uint32_t PRNG::Below(uint32_t bound)
+{
+  if (!bound)
+    return Next();
+
+  uint64_t m = static_cast<uint64_t>(Next()) * bound;
+  uint32_t low = static_cast<uint32_t>(m);
+
+  if (low < bound)
+  {
+    uint32_t threshold = (0u - bound) % bound;
+    while (low < threshold)
+    {
+      m = static_cast<uint64_t>(Next()) * bound;
+      low = static_cast<uint32_t>(m);
+    }
+  }
+
+  return static_cast<uint32_t>(m >> 32);
+}
+
+int PRNG::Range(int low, int high)
+{
+  uint32_t span = static_cast<uint32_t>(high) - static_cast<uint32_t>(low) + 1;
+  return static_cast<int>(static_cast<uint32_t>(low) + Below(span));
+}
+
+void PRNG::fill(uint32_t *out, size_t n)
+{
+  while (n >= LANES)
+  {
+    fill_block(out);
+    out += LANES;
+    n -= LANES;
+  }
+
+  if (n)
+  {
+    uint32_t block[LANES];
+    fill_block(block);
+    for (size_t i = 0; i < n; ++i)
+      out[i] = block[i];
+  }
+}
+
+#if defined(PRNG_SSE2)
+
+// SSE2 has no 32-bit multiply, but both MWC factors fit in 16 bits: build
+// the 32-bit product from the low and high halves of a 16x16 multiply
+static inline __m128i mwc_lanes(__m128i x, __m128i a)
+{
+  __m128i low16 = _mm_and_si128(x, _mm_set1_epi32(0xFFFF));
+  __m128i lo = _mm_mullo_epi16(low16, a);
+  __m128i hi = _mm_mulhi_epu16(low16, a);
+  __m128i product = _mm_or_si128(_mm_and_si128(lo, _mm_set1_epi32(0xFFFF)), _mm_slli_epi32(hi, 16));
+  return _mm_add_epi32(product, _mm_srli_epi32(x, 16));
+}
+
+static inline __m128i rotl_lanes(__m128i x, int k)
+{
+  return _mm_or_si128(_mm_slli_epi32(x, k), _mm_srli_epi32(x, 32 - k));
+}
+
+void PRNG::fill_block(uint32_t *out)
+{
+  __m128i *state[4];
+  for (unsigned word = 0; word < 4; ++word)
+    state[word] = reinterpret_cast<__m128i *>(lanes_[word]);
+
+  for (unsigned half = 0; half < LANES / 4; ++half)
+  {
+    __m128i result;
+
+    if (engine_ == MWC)
+    {
+      __m128i x = mwc_lanes(_mm_loadu_si128(state[0] + half), _mm_set1_epi32(MWC_A));
+      __m128i y = mwc_lanes(_mm_loadu_si128(state[1] + half), _mm_set1_epi32(MWC_B));
+
+      _mm_storeu_si128(state[0] + half, x);
+      _mm_storeu_si128(state[1] + half, y);
+      result = _mm_add_epi32(_mm_slli_epi32(x, 16), _mm_and_si128(y, _mm_set1_epi32(0xFFFF)));
+    }
+    else
+    {
+      __m128i s0 = _mm_loadu_si128(state[0] + half);
+      __m128i s1 = _mm_loadu_si128(state[1] + half);
+      __m128i s2 = _mm_loadu_si128(state[2] + half);
+      __m128i s3 = _mm_loadu_si128(state[3] + half);
+
+      // rotl(s1 * 5, 7) * 9, with the multiplies done as shift-and-add
+      __m128i times5 = _mm_add_epi32(_mm_slli_epi32(s1, 2), s1);
+      __m128i rotated = rotl_lanes(times5, 7);
+      result = _mm_add_epi32(_mm_slli_epi32(rotated, 3), rotated);
+
+      __m128i t = _mm_slli_epi32(s1, 9);
+      s2 = _mm_xor_si128(s2, s0);
+      s3 = _mm_xor_si128(s3, s1);
+      s1 = _mm_xor_si128(s1, s2);
+      s0 = _mm_xor_si128(s0, s3);
+      s2 = _mm_xor_si128(s2, t);
+      s3 = rotl_lanes(s3, 11);
+
+      _mm_storeu_si128(state[0] + half, s0);
+      _mm_storeu_si128(state[1] + half, s1);
+      _mm_storeu_si128(state[2] + half, s2);
+      _mm_storeu_si128(state[3] + half, s3);
+    }
+
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out) + half, result);
+  }
+}
+
+#else
+
+void PRNG::fill_block(uint32_t *out)
+{
+  for (unsigned lane = 0; lane < LANES; ++lane)
+  {
+    if (engine_ == MWC)
+      out[lane] = mwc_step(lanes_[0][lane], lanes_[1][lane]);
+    else
+      out[lane] = xoshiro_step(lanes_[0][lane], lanes_[1][lane], lanes_[2][lane], lanes_[3][lane]);
+  }
+}
+
+#endif
+
 } // namespace Utils
 
 } // namespace Digipen
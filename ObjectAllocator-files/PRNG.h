@@ -3,13 +3,53 @@
 #define PRNGH
 //---------------------------------------------------------------------------
 
+#include <cstddef>
+#include <cstdint>
+
 namespace Digipen
 {
   namespace Utils
   {
     unsigned rand(void);              // returns a random 32-bit integer
-    void srand(unsigned, unsigned);   // seed the generator
-    int Random(int low, int high);    // range
+    void srand(unsigned, unsigned);   // seed the calling thread's generator
+    int Random(int low, int high);    // range (modulo; kept for existing outputs)
+
+    // Stateful generator. Each object is an independent, reproducible stream,
+    // so threads never share state. The MWC engine is the same
+    // multiply-with-carry core as rand(); XOSHIRO is xoshiro128**.
+    class PRNG
+    {
+    public:
+      enum ENGINE { MWC, XOSHIRO };
+
+      // fill() runs this many interleaved streams side by side
+      static const unsigned LANES = 8;
+
+      // Zero seeds select the defaults (for MWC, the same stream as rand())
+      explicit PRNG(unsigned seed1 = 0, unsigned seed2 = 0, ENGINE engine = MWC);
+
+      void Seed(unsigned seed1, unsigned seed2);  // zero keeps the current value
+      ENGINE Engine(void) const { return engine_; }
+
+      uint32_t Next(void);                        // random 32-bit integer
+      uint32_t Below(uint32_t bound);             // unbiased in [0, bound), 0 = any
+      int Range(int low, int high);               // unbiased in [low, high]
+
+      // Writes n random integers. Values come from LANES streams seeded
+      // from this generator's seeds and stepped together with SIMD where
+      // available; the output is identical with or without SIMD. A partial
+      // last block still advances every lane.
+      void fill(uint32_t *out, size_t n);
+
+    private:
+      void seed_lanes(void);
+      void fill_block(uint32_t *out);             // LANES values
+
+      ENGINE engine_;
+      uint32_t x_, y_;                            // MWC state for Next()
+      uint32_t s_[4];                             // xoshiro state for Next()
+      uint32_t lanes_[4][LANES];                  // per-lane state for fill()
+    };
   }
 }
 #endif
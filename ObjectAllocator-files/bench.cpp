@@ -0,0 +1,327 @@
+// oa_bench: repeatable microbenchmarks for ObjectAllocator
+//
+//   oa_bench [--objects N] [--reps N] [--warmup N] [--filter TEXT] [--json FILE]
+//
+// Every benchmark allocates --objects blocks and frees them again in a given
+// order. Each one runs --warmup untimed rounds, then --reps timed rounds, and
+// reports the per-operation time as min/median/mean/stddev/max. The random
+// free order comes from a fixed PRNG seed, so runs are comparable. With
+// --json the results are also written as JSON ("-" for stdout).
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+#include "ObjectAllocator.h"
+#include "PRNG.h"
+
+namespace
+{
+  enum FREE_ORDER { foLIFO, foFIFO, foRandom };
+
+  struct BenchSpec
+  {
+    std::string Name;
+    size_t ObjectSize;
+    OAConfig::HBLOCK_TYPE Header;
+    unsigned PadBytes;
+    FREE_ORDER Order;
+    bool NewDelete;
+  };
+
+  struct BenchResult
+  {
+    std::string Name;
+    unsigned long long Ops;      // allocations + frees per round
+    double Min;                  // ns per op
+    double Median;
+    double Mean;
+    double StdDev;
+    double Max;
+  };
+
+  struct BenchOptions
+  {
+    unsigned Objects;
+    unsigned Reps;
+    unsigned Warmup;
+    const char *Filter;
+    const char *Json;
+  };
+
+  const unsigned BENCH_SEED = 0x0A110C8;
+  const unsigned OBJECTS_PER_PAGE = 64;
+
+  const char *order_name(FREE_ORDER order)
+  {
+    return order == foLIFO ? "lifo" : order == foFIFO ? "fifo" : "random";
+  }
+
+  const char *header_name(OAConfig::HBLOCK_TYPE type)
+  {
+    switch (type)
+    {
+      case OAConfig::hbBasic: return "basic";
+      case OAConfig::hbExtended: return "extended";
+      case OAConfig::hbExternal: return "external";
+      default: return "none";
+    }
+  }
+
+  BenchSpec make_spec(size_t size, OAConfig::HBLOCK_TYPE header, unsigned pad,
+    FREE_ORDER order, bool newdelete)
+  {
+    BenchSpec spec;
+    char name[128];
+
+    std::sprintf(name, "%s/size=%u/header=%s/pad=%u/%s",
+      newdelete ? "newdelete" : "pool", static_cast<unsigned>(size),
+      header_name(header), pad, order_name(order));
+
+    spec.Name = name;
+    spec.ObjectSize = size;
+    spec.Header = header;
+    spec.PadBytes = pad;
+    spec.Order = order;
+    spec.NewDelete = newdelete;
+    return spec;
+  }
+
+  // The benchmark matrix: object sizes, free orders, header types, pad sizes
+  std::vector<BenchSpec> all_specs(void)
+  {
+    static const size_t sizes[] = { 8, 16, 32, 64, 256, 1024 };
+    static const FREE_ORDER orders[] = { foLIFO, foFIFO, foRandom };
+    static const OAConfig::HBLOCK_TYPE headers[] =
+      { OAConfig::hbBasic, OAConfig::hbExtended, OAConfig::hbExternal };
+    static const unsigned pads[] = { 8, 32 };
+
+    std::vector<BenchSpec> specs;
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); ++i)
+      specs.push_back(make_spec(sizes[i], OAConfig::hbNone, 0, foLIFO, false));
+    for (size_t i = 0; i < sizeof(orders) / sizeof(*orders); ++i)
+    {
+      if (orders[i] != foLIFO)
+        specs.push_back(make_spec(32, OAConfig::hbNone, 0, orders[i], false));
+    }
+    for (size_t i = 0; i < sizeof(headers) / sizeof(*headers); ++i)
+      specs.push_back(make_spec(32, headers[i], 0, foLIFO, false));
+    for (size_t i = 0; i < sizeof(pads) / sizeof(*pads); ++i)
+      specs.push_back(make_spec(32, OAConfig::hbNone, pads[i], foLIFO, false));
+    for (size_t i = 0; i < sizeof(orders) / sizeof(*orders); ++i)
+      specs.push_back(make_spec(32, OAConfig::hbNone, 0, orders[i], true));
+
+    return specs;
+  }
+
+  // Puts ptrs into the order the round will free them in
+  void order_pointers(std::vector<void *> &ptrs, FREE_ORDER order, Digipen::Utils::PRNG &rng)
+  {
+    if (order == foLIFO)
+    {
+      std::reverse(ptrs.begin(), ptrs.end());
+    }
+    else if (order == foRandom)
+    {
+      for (size_t i = ptrs.size(); i > 1; --i)
+      {
+        size_t j = rng.Below(static_cast<uint32_t>(i));
+        std::swap(ptrs[i - 1], ptrs[j]);
+      }
+    }
+  }
+
+  // One round: allocate everything, free everything. Returns elapsed ns.
+  double run_round(ObjectAllocator &oa, const BenchSpec &spec, std::vector<void *> &ptrs,
+    Digipen::Utils::PRNG &rng)
+  {
+    typedef std::chrono::steady_clock clock;
+    const char *label = spec.Header == OAConfig::hbExternal ? "bench" : nullptr;
+
+    clock::time_point start = clock::now();
+
+    for (size_t i = 0; i < ptrs.size(); ++i)
+    {
+      ptrs[i] = oa.Allocate(label);
+    }
+
+    clock::time_point allocated = clock::now();
+
+    // Reordering is not part of the measurement
+    order_pointers(ptrs, spec.Order, rng);
+
+    clock::time_point freestart = clock::now();
+
+    for (size_t i = 0; i < ptrs.size(); ++i)
+    {
+      oa.Free(ptrs[i]);
+    }
+
+    clock::time_point end = clock::now();
+
+    return std::chrono::duration<double, std::nano>((allocated - start) + (end - freestart)).count();
+  }
+
+  BenchResult run_bench(const BenchSpec &spec, const BenchOptions &options)
+  {
+    unsigned pages = options.Objects / OBJECTS_PER_PAGE + 1;
+    OAConfig config(spec.NewDelete, OBJECTS_PER_PAGE, pages, false, spec.PadBytes,
+      OAConfig::HeaderBlockInfo(spec.Header), 0);
+    ObjectAllocator oa(spec.ObjectSize, config);
+    std::vector<void *> ptrs(options.Objects);
+    std::vector<double> samples;
+    Digipen::Utils::PRNG rng(BENCH_SEED, BENCH_SEED + 1);
+
+    // Warm-up grows the pool to full size and warms the caches
+    for (unsigned i = 0; i < options.Warmup; ++i)
+    {
+      run_round(oa, spec, ptrs, rng);
+    }
+
+    double ops = 2.0 * options.Objects;
+    for (unsigned i = 0; i < options.Reps; ++i)
+    {
+      samples.push_back(run_round(oa, spec, ptrs, rng) / ops);
+    }
+
+    std::sort(samples.begin(), samples.end());
+
+    BenchResult result;
+    double sum = 0.0;
+    double squares = 0.0;
+    size_t n = samples.size();
+
+    for (size_t i = 0; i < n; ++i)
+    {
+      sum += samples[i];
+    }
+    result.Mean = sum / static_cast<double>(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+      squares += (samples[i] - result.Mean) * (samples[i] - result.Mean);
+    }
+
+    result.Name = spec.Name;
+    result.Ops = 2ULL * options.Objects;
+    result.Min = samples.front();
+    result.Max = samples.back();
+    result.Median = n % 2 ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) / 2.0;
+    result.StdDev = n > 1 ? std::sqrt(squares / static_cast<double>(n - 1)) : 0.0;
+    return result;
+  }
+
+  void write_json(std::FILE *out, const BenchOptions &options, const std::vector<BenchResult> &results)
+  {
+    char date[64];
+    std::time_t now = std::time(nullptr);
+    std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", std::localtime(&now));
+
+    std::fprintf(out, "{\n  \"context\": {\"date\": \"%s\", \"objects\": %u, \"reps\": %u, "
+      "\"warmup\": %u, \"objects_per_page\": %u, \"unit\": \"ns/op\"},\n  \"benchmarks\": [\n",
+      date, options.Objects, options.Reps, options.Warmup, OBJECTS_PER_PAGE);
+
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+      const BenchResult &r = results[i];
+      std::fprintf(out, "    {\"name\": \"%s\", \"ops\": %llu, \"min\": %.3f, \"median\": %.3f, "
+        "\"mean\": %.3f, \"stddev\": %.3f, \"max\": %.3f, \"ops_per_sec\": %.0f}%s\n",
+        r.Name.c_str(), r.Ops, r.Min, r.Median, r.Mean, r.StdDev, r.Max,
+        r.Median > 0.0 ? 1e9 / r.Median : 0.0, i + 1 < results.size() ? "," : "");
+    }
+
+    std::fprintf(out, "  ]\n}\n");
+  }
+
+  bool parse(int argc, char **argv, BenchOptions &options)
+  {
+    options.Objects = 4096;
+    options.Reps = 15;
+    options.Warmup = 3;
+    options.Filter = nullptr;
+    options.Json = nullptr;
+
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+      const char *arg = argv[i];
+      const char *value = argv[i + 1];
+
+      if (!std::strcmp(arg, "--objects"))
+        options.Objects = static_cast<unsigned>(std::strtoul(value, nullptr, 10));
+      else if (!std::strcmp(arg, "--reps"))
+        options.Reps = static_cast<unsigned>(std::strtoul(value, nullptr, 10));
+      else if (!std::strcmp(arg, "--warmup"))
+        options.Warmup = static_cast<unsigned>(std::strtoul(value, nullptr, 10));
+      else if (!std::strcmp(arg, "--filter"))
+        options.Filter = value;
+      else if (!std::strcmp(arg, "--json"))
+        options.Json = value;
+      else
+        return false;
+    }
+
+    return argc % 2 == 1 && options.Objects > 0 && options.Reps > 0;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  BenchOptions options;
+  if (!parse(argc, argv, options))
+  {
+    std::printf("usage: oa_bench [--objects N] [--reps N] [--warmup N] [--filter TEXT] [--json FILE]\n");
+    return 2;
+  }
+
+  std::vector<BenchSpec> specs = all_specs();
+  std::vector<BenchResult> results;
+  bool quiet = options.Json && !std::strcmp(options.Json, "-");
+
+  if (!quiet)
+  {
+    std::printf("%-44s %10s %10s %10s %10s %10s\n", "benchmark (ns/op)", "min", "median", "mean", "stddev", "max");
+  }
+
+  for (size_t i = 0; i < specs.size(); ++i)
+  {
+    if (options.Filter && specs[i].Name.find(options.Filter) == std::string::npos)
+      continue;
+
+    try
+    {
+      BenchResult result = run_bench(specs[i], options);
+      results.push_back(result);
+
+      if (!quiet)
+      {
+        std::printf("%-44s %10.2f %10.2f %10.2f %10.2f %10.2f\n", result.Name.c_str(),
+          result.Min, result.Median, result.Mean, result.StdDev, result.Max);
+      }
+    }
+    catch (const OAException &e)
+    {
+      std::fprintf(stderr, "%s: %s\n", specs[i].Name.c_str(), e.what());
+      return 1;
+    }
+  }
+
+  if (options.Json)
+  {
+    std::FILE *out = quiet ? stdout : std::fopen(options.Json, "w");
+    if (!out)
+    {
+      std::fprintf(stderr, "cannot write %s\n", options.Json);
+      return 1;
+    }
+    write_json(out, options, results);
+    if (!quiet)
+      std::fclose(out);
+  }
+
+  return 0;
+}
@@ -0,0 +1,377 @@
+// oa_mtbench: multithreaded scaling benchmark and stress harness
+//
+//   oa_mtbench [--threads N] [--ops N] [--working N] [--size N] [--workload NAME]
+//
+// Runs each workload at 1, 2, 4, ... up to --threads threads (N itself is
+// always included) and prints one line per run: throughput plus per-op
+// latency percentiles, ready for plotting scaling curves.
+//
+//   private   every thread owns an ObjectAllocator
+//   shared    all threads share one ObjectAllocator behind a mutex
+//   prodcons  half the threads allocate and hand blocks through a bounded
+//             queue to the other half, which free them (shared pool)
+//
+// Each thread owns a Digipen::Utils::PRNG with its own seed, so a run is
+// reproducible per thread and threads never contend on generator state.
+// After every run the allocator statistics are checked (Allocations_ -
+// Deallocations_ == ObjectsInUse_); the program exits with status 1 if any
+// check fails.
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ObjectAllocator.h"
+#include "PRNG.h"
+
+namespace
+{
+  enum WORKLOAD { wlPrivate, wlShared, wlProdCons };
+
+  struct MTOptions
+  {
+    unsigned Threads;
+    unsigned Ops;        // operations per thread
+    unsigned Working;    // live objects per thread (working set)
+    unsigned Size;       // object size
+    const char *Only;    // run just this workload
+  };
+
+  struct RunResult
+  {
+    unsigned long long Ops;
+    double Seconds;
+    OAHistogram Latency;
+    bool Consistent;
+  };
+
+  const unsigned MT_SEED = 0x5EED;
+  const unsigned OBJECTS_PER_PAGE = 256;
+  const unsigned QUEUE_LIMIT = 1024;
+
+  const char *workload_name(WORKLOAD workload)
+  {
+    return workload == wlPrivate ? "private" : workload == wlShared ? "shared" : "prodcons";
+  }
+
+  OAConfig make_config(void)
+  {
+    // Unbounded: the harness measures contention, not page limits
+    return OAConfig(false, OBJECTS_PER_PAGE, ~0u);
+  }
+
+  // Allocations_ - Deallocations_ must match ObjectsInUse_ at all times
+  bool consistent(const ObjectAllocator &oa, const char *when)
+  {
+    OAStats stats = oa.GetStats();
+    if (stats.Allocations_ - stats.Deallocations_ == stats.ObjectsInUse_)
+      return true;
+
+    std::printf("stats mismatch %s: allocations %u - deallocations %u != in use %u\n",
+      when, stats.Allocations_, stats.Deallocations_, stats.ObjectsInUse_);
+    return false;
+  }
+
+  // Optional lock around a pool; a null mutex means the pool is private
+  class PoolRef
+  {
+  public:
+    PoolRef(ObjectAllocator &oa, std::mutex *lock) : oa_(oa), lock_(lock) {}
+
+    void *Allocate(void)
+    {
+      if (!lock_)
+        return oa_.Allocate();
+      std::lock_guard<std::mutex> guard(*lock_);
+      return oa_.Allocate();
+    }
+
+    void Free(void *object)
+    {
+      if (!lock_)
+      {
+        oa_.Free(object);
+        return;
+      }
+      std::lock_guard<std::mutex> guard(*lock_);
+      oa_.Free(object);
+    }
+
+  private:
+    ObjectAllocator &oa_;
+    std::mutex *lock_;
+  };
+
+  // Random alloc/free churn over a fixed-size working set
+  void churn(PoolRef pool, unsigned thread, const MTOptions &options, OAHistogram &latency)
+  {
+    std::vector<void *> slots(options.Working, nullptr);
+    Digipen::Utils::PRNG rng(MT_SEED + thread, MT_SEED * 3 + thread);
+
+    for (unsigned i = 0; i < options.Ops; ++i)
+    {
+      unsigned slot = rng.Below(options.Working);
+      unsigned long long start = OAClock::Ticks();
+
+      if (slots[slot])
+      {
+        pool.Free(slots[slot]);
+        slots[slot] = nullptr;
+      }
+      else
+      {
+        slots[slot] = pool.Allocate();
+        static_cast<char *>(slots[slot])[0] = static_cast<char>(thread);
+      }
+
+      latency.Record(OAClock::Ticks() - start);
+    }
+
+    for (unsigned i = 0; i < options.Working; ++i)
+    {
+      if (slots[i])
+        pool.Free(slots[i]);
+    }
+  }
+
+  // Bounded hand-off queue for the producer/consumer workload
+  class BlockQueue
+  {
+  public:
+    BlockQueue(void) : producers_(0) {}
+
+    void AddProducer(void)
+    {
+      std::lock_guard<std::mutex> guard(lock_);
+      ++producers_;
+    }
+
+    void ProducerDone(void)
+    {
+      std::lock_guard<std::mutex> guard(lock_);
+      --producers_;
+      ready_.notify_all();
+    }
+
+    void Push(void *block)
+    {
+      std::unique_lock<std::mutex> guard(lock_);
+      while (blocks_.size() >= QUEUE_LIMIT)
+        space_.wait(guard);
+      blocks_.push_back(block);
+      ready_.notify_one();
+    }
+
+    // Returns null once the queue is empty and every producer has finished
+    void *Pop(void)
+    {
+      std::unique_lock<std::mutex> guard(lock_);
+      while (blocks_.empty() && producers_)
+        ready_.wait(guard);
+      if (blocks_.empty())
+        return nullptr;
+      void *block = blocks_.front();
+      blocks_.pop_front();
+      space_.notify_one();
+      return block;
+    }
+
+  private:
+    std::mutex lock_;
+    std::condition_variable ready_;
+    std::condition_variable space_;
+    std::deque<void *> blocks_;
+    unsigned producers_;
+  };
+
+  void produce(PoolRef pool, BlockQueue &queue, unsigned thread, const MTOptions &options, OAHistogram &latency)
+  {
+    Digipen::Utils::PRNG rng(MT_SEED + thread, MT_SEED * 3 + thread);
+
+    for (unsigned i = 0; i < options.Ops; ++i)
+    {
+      unsigned long long start = OAClock::Ticks();
+      void *block = pool.Allocate();
+      latency.Record(OAClock::Ticks() - start);
+
+      static_cast<unsigned char *>(block)[0] = static_cast<unsigned char>(rng.Next());
+      queue.Push(block);
+    }
+
+    queue.ProducerDone();
+  }
+
+  void consume(PoolRef pool, BlockQueue &queue, OAHistogram &latency)
+  {
+    void *block;
+
+    while ((block = queue.Pop()) != nullptr)
+    {
+      unsigned long long start = OAClock::Ticks();
+      pool.Free(block);
+      latency.Record(OAClock::Ticks() - start);
+    }
+  }
+
+  void run(WORKLOAD workload, unsigned threads, const MTOptions &options, RunResult &result)
+  {
+    typedef std::chrono::steady_clock clock;
+    std::vector<OAHistogram> latency(threads + 1);   // last one: this thread
+    std::vector<std::thread> workers;
+    std::vector<ObjectAllocator *> pools;
+    std::mutex lock;
+    BlockQueue queue;
+
+    // Private pools are created up front so construction isn't timed
+    unsigned poolcount = workload == wlPrivate ? threads : 1;
+    for (unsigned i = 0; i < poolcount; ++i)
+    {
+      pools.push_back(new ObjectAllocator(options.Size, make_config()));
+    }
+
+    // With a single thread the producer runs alone and this thread consumes
+    unsigned producers = workload == wlProdCons ? (threads + 1) / 2 : 0;
+    for (unsigned i = 0; i < producers; ++i)
+    {
+      queue.AddProducer();
+    }
+
+    clock::time_point start = clock::now();
+
+    for (unsigned t = 0; t < threads; ++t)
+    {
+      if (workload == wlPrivate)
+        workers.push_back(std::thread(churn, PoolRef(*pools[t], nullptr), t, std::cref(options), std::ref(latency[t])));
+      else if (workload == wlShared)
+        workers.push_back(std::thread(churn, PoolRef(*pools[0], &lock), t, std::cref(options), std::ref(latency[t])));
+      else if (t < producers)
+        workers.push_back(std::thread(produce, PoolRef(*pools[0], &lock), std::ref(queue), t, std::cref(options), std::ref(latency[t])));
+      else
+        workers.push_back(std::thread(consume, PoolRef(*pools[0], &lock), std::ref(queue), std::ref(latency[t])));
+    }
+
+    if (workload == wlProdCons && threads == 1)
+      consume(PoolRef(*pools[0], &lock), queue, latency[threads]);
+
+    for (size_t i = 0; i < workers.size(); ++i)
+    {
+      workers[i].join();
+    }
+
+    result.Seconds = std::chrono::duration<double>(clock::now() - start).count();
+    result.Consistent = true;
+    result.Ops = 0;
+    result.Latency.Reset();
+
+    for (unsigned t = 0; t <= threads; ++t)
+    {
+      result.Latency.Merge(latency[t]);
+    }
+    result.Ops = result.Latency.Count();
+
+    for (unsigned i = 0; i < poolcount; ++i)
+    {
+      if (!consistent(*pools[i], "after run"))
+        result.Consistent = false;
+      if (pools[i]->GetStats().ObjectsInUse_)
+      {
+        std::printf("pool %u still has %u objects in use\n", i, pools[i]->GetStats().ObjectsInUse_);
+        result.Consistent = false;
+      }
+      delete pools[i];
+    }
+  }
+
+  bool parse(int argc, char **argv, MTOptions &options)
+  {
+    options.Threads = std::thread::hardware_concurrency();
+    if (!options.Threads)
+      options.Threads = 4;
+    options.Ops = 200000;
+    options.Working = 1024;
+    options.Size = 32;
+    options.Only = nullptr;
+
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+      const char *arg = argv[i];
+      unsigned value = static_cast<unsigned>(std::strtoul(argv[i + 1], nullptr, 10));
+
+      if (!std::strcmp(arg, "--threads"))
+        options.Threads = value;
+      else if (!std::strcmp(arg, "--ops"))
+        options.Ops = value;
+      else if (!std::strcmp(arg, "--working"))
+        options.Working = value;
+      else if (!std::strcmp(arg, "--size"))
+        options.Size = value;
+      else if (!std::strcmp(arg, "--workload"))
+        options.Only = argv[i + 1];
+      else
+        return false;
+    }
+
+    return argc % 2 == 1 && options.Threads && options.Ops && options.Working && options.Size;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  MTOptions options;
+  if (!parse(argc, argv, options))
+  {
+    std::printf("usage: oa_mtbench [--threads N] [--ops N] [--working N] [--size N] "
+      "[--workload private|shared|prodcons]\n");
+    return 2;
+  }
+
+  static const WORKLOAD workloads[] = { wlPrivate, wlShared, wlProdCons };
+  bool ok = true;
+
+  std::printf("%-9s %7s %12s %9s %10s %9s %9s %9s %11s\n", "workload", "threads", "ops", "seconds",
+    "Mops/s", "p50 ns", "p99 ns", "p99.9 ns", "max ns");
+
+  for (size_t w = 0; w < sizeof(workloads) / sizeof(*workloads); ++w)
+  {
+    if (options.Only && std::strcmp(options.Only, workload_name(workloads[w])))
+      continue;
+
+    for (unsigned threads = 1; ; threads *= 2)
+    {
+      if (threads > options.Threads)
+        threads = options.Threads;
+
+      RunResult result;
+      try
+      {
+        run(workloads[w], threads, options, result);
+      }
+      catch (const OAException &e)
+      {
+        std::printf("%s/%u: %s\n", workload_name(workloads[w]), threads, e.what());
+        return 1;
+      }
+
+      ok = ok && result.Consistent;
+      std::printf("%-9s %7u %12llu %9.3f %10.3f %9.0f %9.0f %9.0f %11.0f%s\n",
+        workload_name(workloads[w]), threads, result.Ops, result.Seconds,
+        static_cast<double>(result.Ops) / result.Seconds / 1e6,
+        OAClock::ToNanoseconds(result.Latency.Percentile(50.0)),
+        OAClock::ToNanoseconds(result.Latency.Percentile(99.0)),
+        OAClock::ToNanoseconds(result.Latency.Percentile(99.9)),
+        OAClock::ToNanoseconds(result.Latency.Max()),
+        result.Consistent ? "" : "  STATS MISMATCH");
+
+      if (threads == options.Threads)
+        break;
+    }
+  }
+
+  return ok ? 0 : 1;
+}
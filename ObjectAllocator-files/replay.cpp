@@ -0,0 +1,346 @@
+// oa_replay: replays an OATraceRecorder trace against ObjectAllocator
+//
+//   oa_replay TRACE [options]
+//
+//   --pool N          pool id to replay (default 0)
+//   --objects N       objects per page (default: as recorded)
+//   --pages N         max pages, 0 = unlimited (default)
+//   --pad N           pad bytes
+//   --header TYPE     none | basic | extended | external
+//   --extra N         user-defined bytes for extended headers
+//   --align N         block alignment
+//   --debug           enable debug checks
+//   --newdelete       bypass the pool and use new/delete
+//   --repeat N        replay the trace N times (default 1)
+//
+// Reports ops/sec, RSS before the replay and at its peak, page count and
+// latency percentiles.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_map>
+#include "ObjectAllocator.h"
+#include "OATrace.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+  struct ReplayOptions
+  {
+    const char *Trace;
+    unsigned Pool;
+    bool HaveObjects;
+    unsigned Objects;
+    unsigned Pages;
+    unsigned Pad;
+    OAConfig::HBLOCK_TYPE Header;
+    unsigned Extra;
+    unsigned Alignment;
+    bool Debug;
+    bool NewDelete;
+    unsigned Repeat;
+  };
+
+  struct ReplayResult
+  {
+    unsigned long long Allocations;
+    unsigned long long Frees;
+    unsigned long long Failures;     // exceptions thrown by the allocator
+    unsigned long long Unmatched;    // frees whose allocation was never recorded
+    unsigned MostPages;
+    double Seconds;
+  };
+
+  void usage(void)
+  {
+    std::printf("usage: oa_replay TRACE [--pool N] [--objects N] [--pages N] [--pad N]\n"
+      "                 [--header none|basic|extended|external] [--extra N]\n"
+      "                 [--align N] [--debug] [--newdelete] [--repeat N]\n");
+  }
+
+  bool parse(int argc, char **argv, ReplayOptions &options)
+  {
+    options.Trace = nullptr;
+    options.Pool = 0;
+    options.HaveObjects = false;
+    options.Objects = DEFAULT_OBJECTS_PER_PAGE;
+    options.Pages = 0;
+    options.Pad = 0;
+    options.Header = OAConfig::hbNone;
+    options.Extra = 0;
+    options.Alignment = 0;
+    options.Debug = false;
+    options.NewDelete = false;
+    options.Repeat = 1;
+
+    for (int i = 1; i < argc; ++i)
+    {
+      const char *arg = argv[i];
+      const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+      unsigned number = value ? static_cast<unsigned>(std::strtoul(value, nullptr, 10)) : 0;
+
+      if (!std::strcmp(arg, "--debug"))
+        options.Debug = true;
+      else if (!std::strcmp(arg, "--newdelete"))
+        options.NewDelete = true;
+      else if (arg[0] != '-')
+        options.Trace = arg;
+      else if (!value)
+        return false;
+      else
+      {
+        ++i;
+        if (!std::strcmp(arg, "--pool"))
+          options.Pool = number;
+        else if (!std::strcmp(arg, "--objects"))
+        {
+          options.Objects = number;
+          options.HaveObjects = true;
+        }
+        else if (!std::strcmp(arg, "--pages"))
+          options.Pages = number;
+        else if (!std::strcmp(arg, "--pad"))
+          options.Pad = number;
+        else if (!std::strcmp(arg, "--extra"))
+          options.Extra = number;
+        else if (!std::strcmp(arg, "--align"))
+          options.Alignment = number;
+        else if (!std::strcmp(arg, "--repeat"))
+          options.Repeat = number ? number : 1;
+        else if (!std::strcmp(arg, "--header"))
+        {
+          if (!std::strcmp(value, "none"))
+            options.Header = OAConfig::hbNone;
+          else if (!std::strcmp(value, "basic"))
+            options.Header = OAConfig::hbBasic;
+          else if (!std::strcmp(value, "extended"))
+            options.Header = OAConfig::hbExtended;
+          else if (!std::strcmp(value, "external"))
+            options.Header = OAConfig::hbExternal;
+          else
+            return false;
+        }
+        else
+          return false;
+      }
+    }
+
+    return options.Trace != nullptr;
+  }
+
+  // Peak resident set size of the process in kilobytes
+  unsigned long long peak_rss_kb(void)
+  {
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+      return 0;
+    return static_cast<unsigned long long>(counters.PeakWorkingSetSize) / 1024;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage))
+      return 0;
+#if defined(__APPLE__)
+    return static_cast<unsigned long long>(usage.ru_maxrss) / 1024;
+#else
+    return static_cast<unsigned long long>(usage.ru_maxrss);
+#endif
+#endif
+  }
+
+  // Resident set size of the process now in kilobytes (0 if unknown)
+  unsigned long long current_rss_kb(void)
+  {
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+      return 0;
+    return static_cast<unsigned long long>(counters.WorkingSetSize) / 1024;
+#elif defined(__linux__)
+    unsigned long long size = 0;
+    unsigned long long resident = 0;
+    std::FILE *file = std::fopen("/proc/self/statm", "r");
+    if (!file)
+      return 0;
+    if (std::fscanf(file, "%llu %llu", &size, &resident) != 2)
+      resident = 0;
+    std::fclose(file);
+    return resident * static_cast<unsigned long long>(sysconf(_SC_PAGESIZE)) / 1024;
+#else
+    return 0;
+#endif
+  }
+
+  // Drops the peak RSS down to the current RSS (Linux), so a later peak is
+  // the highest point since now. That still counts the loaded trace: the
+  // replay's own share is the peak minus the RSS at this point.
+  void reset_peak_rss(void)
+  {
+#if defined(__linux__)
+    std::FILE *file = std::fopen("/proc/self/clear_refs", "w");
+    if (file)
+    {
+      std::fputs("5", file);
+      std::fclose(file);
+    }
+#endif
+  }
+
+  void replay(const OATraceReader &reader, const ReplayOptions &options,
+    ObjectAllocator &oa, ReplayResult &result)
+  {
+    typedef std::chrono::steady_clock clock;
+    const std::vector<OATraceEvent> &events = reader.Events();
+    const std::vector<std::string> &labels = reader.Labels();
+    std::unordered_map<unsigned long long, void *> live;
+
+    clock::time_point start = clock::now();
+
+    for (unsigned pass = 0; pass < options.Repeat; ++pass)
+    {
+      for (size_t i = 0; i < events.size(); ++i)
+      {
+        const OATraceEvent &event = events[i];
+
+        if (event.Pool != options.Pool)
+          continue;
+
+        try
+        {
+          if (event.Op == OATraceRecorder::opAllocate)
+          {
+            const char *label = event.Label ? labels[event.Label - 1].c_str() : "";
+            live[event.Slot] = oa.Allocate(label);
+            ++result.Allocations;
+          }
+          else if (event.Op == OATraceRecorder::opFree)
+          {
+            std::unordered_map<unsigned long long, void *>::iterator found = live.find(event.Slot);
+            if (found == live.end())
+            {
+              ++result.Unmatched;
+              continue;
+            }
+            void *object = found->second;
+            live.erase(found);
+            oa.Free(object);
+            ++result.Frees;
+          }
+        }
+        catch (const OAException &)
+        {
+          ++result.Failures;
+        }
+      }
+
+      // Whatever the recording left allocated is released between passes
+      for (std::unordered_map<unsigned long long, void *>::iterator it = live.begin(); it != live.end(); ++it)
+      {
+        oa.Free(it->second);
+        ++result.Frees;
+      }
+      live.clear();
+    }
+
+    result.Seconds = std::chrono::duration<double>(clock::now() - start).count();
+
+    // Nothing in a replay releases pages, so the final count is the peak
+    // (read here so it isn't timed)
+    result.MostPages = oa.GetStats().PagesInUse_;
+  }
+
+  void print_latency(const char *name, const OAHistogram &histogram)
+  {
+    std::printf("%-9s n=%-10llu p50=%8.0f p90=%8.0f p99=%8.0f p99.9=%8.0f max=%10.0f ns\n",
+      name, histogram.Count(),
+      OAClock::ToNanoseconds(histogram.Percentile(50.0)),
+      OAClock::ToNanoseconds(histogram.Percentile(90.0)),
+      OAClock::ToNanoseconds(histogram.Percentile(99.0)),
+      OAClock::ToNanoseconds(histogram.Percentile(99.9)),
+      OAClock::ToNanoseconds(histogram.Max()));
+  }
+}
+
+int main(int argc, char **argv)
+{
+  ReplayOptions options;
+  if (!parse(argc, argv, options))
+  {
+    usage();
+    return 2;
+  }
+
+  OATraceReader reader;
+  if (!reader.Load(options.Trace))
+  {
+    std::printf("oa_replay: %s\n", reader.Error().c_str());
+    return 1;
+  }
+
+  if (options.Pool >= reader.Pools().size())
+  {
+    std::printf("oa_replay: trace has no pool %u\n", options.Pool);
+    return 1;
+  }
+
+  const OATracePool &pool = reader.Pools()[options.Pool];
+  unsigned objects = options.HaveObjects ? options.Objects : pool.ObjectsPerPage_;
+  unsigned pages = options.Pages ? options.Pages : ~0u;
+
+  OAConfig config(options.NewDelete, objects, pages, options.Debug, options.Pad,
+    OAConfig::HeaderBlockInfo(options.Header, options.Extra), options.Alignment);
+  config.LatencyStats_ = true;
+
+  std::printf("trace: %s, %u events, %u labels, %llu dropped%s\n", options.Trace,
+    static_cast<unsigned>(reader.Events().size()), static_cast<unsigned>(reader.Labels().size()),
+    reader.Dropped(), reader.Complete() ? "" : " (incomplete)");
+  std::printf("config: objsize=%u objects/page=%u maxpages=%u pad=%u header=%d align=%u%s%s\n",
+    static_cast<unsigned>(pool.ObjectSize_), objects, options.Pages, options.Pad, static_cast<int>(options.Header), options.Alignment,
+    options.Debug ? " debug" : "", options.NewDelete ? " newdelete" : "");
+
+  ReplayResult result;
+  std::memset(&result, 0, sizeof(result));
+
+  try
+  {
+    unsigned long long baseline;
+
+    reset_peak_rss();
+    baseline = current_rss_kb();
+    ObjectAllocator oa(pool.ObjectSize_, config);
+    replay(reader, options, oa, result);
+
+    OALatencyStats latency;
+    oa.GetLatencyStats(latency);
+
+    unsigned long long ops = result.Allocations + result.Frees;
+    std::printf("ops: %llu (%llu allocs, %llu frees) in %.3f s = %.0f ops/sec\n",
+      ops, result.Allocations, result.Frees, result.Seconds,
+      result.Seconds > 0.0 ? static_cast<double>(ops) / result.Seconds : 0.0);
+    std::printf("failures: %llu, unmatched frees: %llu\n", result.Failures, result.Unmatched);
+    std::printf("pages: peak %u, final %u\n", result.MostPages, oa.GetStats().PagesInUse_);
+    unsigned long long peak = peak_rss_kb();
+    std::printf("rss: %llu KB before replay (trace loaded), peak %llu KB, replay added %llu KB\n",
+      baseline, peak, peak > baseline ? peak - baseline : 0);
+    print_latency("allocate", latency.Allocate_);
+    print_latency("free", latency.Free_);
+    print_latency("new page", latency.NewPage_);
+  }
+  catch (const OAException &e)
+  {
+    std::printf("oa_replay: %s\n", e.what());
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,175 @@
+// oa_rtlatency: worst-case Allocate/Free latency of a real-time pool
+//
+//   oa_rtlatency [--ops N] [--objects N] [--size N] [--pad N] [--debug] [--bound NS]
+//
+// Builds an OAConfig::RealTime_ pool with room for --objects live blocks,
+// then runs --ops operations (default 10^8) of random churn over them: a
+// slot holding a block frees it, an empty slot allocates one (TryAllocate/
+// TryFree, so nothing throws). Every call is timed on its own and the
+// percentiles and max are printed per call. With --bound the program exits
+// with status 1 if either max exceeds NS nanoseconds, or if any call fails.
+//
+// The max includes whatever the OS does to the thread (interrupts,
+// preemption, SMIs), so run it isolated for a meaningful bound, e.g.
+//   chrt -f 80 taskset -c 3 ./oa_rtlatency --bound 2000
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "ObjectAllocator.h"
+#include "PRNG.h"
+
+namespace
+{
+  struct RTOptions
+  {
+    unsigned long long Ops;
+    unsigned Objects;
+    unsigned Size;
+    unsigned Pad;
+    bool Debug;
+    double Bound;     // ns, 0 = report only
+  };
+
+  const unsigned RT_SEED = 0x7EA1;
+  const unsigned OBJECTS_PER_PAGE = 256;
+
+  bool parse(int argc, char **argv, RTOptions &options)
+  {
+    options.Ops = 100000000ULL;
+    options.Objects = 4096;
+    options.Size = 32;
+    options.Pad = 0;
+    options.Debug = false;
+    options.Bound = 0.0;
+
+    for (int i = 1; i < argc; ++i)
+    {
+      const char *arg = argv[i];
+      const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+
+      if (!std::strcmp(arg, "--debug"))
+      {
+        options.Debug = true;
+        continue;
+      }
+      if (!value)
+        return false;
+      ++i;
+
+      if (!std::strcmp(arg, "--ops"))
+        options.Ops = std::strtoull(value, nullptr, 10);
+      else if (!std::strcmp(arg, "--objects"))
+        options.Objects = static_cast<unsigned>(std::strtoul(value, nullptr, 10));
+      else if (!std::strcmp(arg, "--size"))
+        options.Size = static_cast<unsigned>(std::strtoul(value, nullptr, 10));
+      else if (!std::strcmp(arg, "--pad"))
+        options.Pad = static_cast<unsigned>(std::strtoul(value, nullptr, 10));
+      else if (!std::strcmp(arg, "--bound"))
+        options.Bound = std::strtod(value, nullptr);
+      else
+        return false;
+    }
+
+    return options.Ops && options.Objects && options.Size;
+  }
+
+  void print_latency(const char *name, const OAHistogram &histogram)
+  {
+    std::printf("%-9s n=%-10llu p50=%6.0f p99=%6.0f p99.99=%7.0f p99.9999=%8.0f max=%9.0f ns\n",
+      name, histogram.Count(),
+      OAClock::ToNanoseconds(histogram.Percentile(50.0)),
+      OAClock::ToNanoseconds(histogram.Percentile(99.0)),
+      OAClock::ToNanoseconds(histogram.Percentile(99.99)),
+      OAClock::ToNanoseconds(histogram.Percentile(99.9999)),
+      OAClock::ToNanoseconds(histogram.Max()));
+  }
+}
+
+int main(int argc, char **argv)
+{
+  RTOptions options;
+  if (!parse(argc, argv, options))
+  {
+    std::printf("usage: oa_rtlatency [--ops N] [--objects N] [--size N] [--pad N] [--debug] [--bound NS]\n");
+    return 2;
+  }
+
+  unsigned pages = (options.Objects + OBJECTS_PER_PAGE - 1) / OBJECTS_PER_PAGE;
+  OAConfig config(false, OBJECTS_PER_PAGE, pages, options.Debug, options.Pad);
+  config.RealTime_ = true;
+
+  ObjectAllocator *oa;
+  try
+  {
+    oa = new ObjectAllocator(options.Size, config);
+  }
+  catch (const OAException &e)
+  {
+    std::printf("oa_rtlatency: %s\n", e.what());
+    return 1;
+  }
+
+  // Built (and so faulted in) before the clock starts
+  std::vector<void *> slots(options.Objects, nullptr);
+  Digipen::Utils::PRNG rng(RT_SEED, RT_SEED + 1);
+  OAHistogram allocations;
+  OAHistogram frees;
+  unsigned long long failures = 0;
+
+  std::printf("config: size=%u objects=%u pages=%u pad=%u%s ops=%llu\n", options.Size,
+    options.Objects, pages, options.Pad, options.Debug ? " debug" : "", options.Ops);
+
+  for (unsigned long long i = 0; i < options.Ops; ++i)
+  {
+    unsigned slot = rng.Below(options.Objects);
+    unsigned long long start;
+    unsigned long long end;
+
+    if (slots[slot])
+    {
+      start = OAClock::Ticks();
+      ObjectAllocator::OA_ERROR error = oa->TryFree(slots[slot]);
+      end = OAClock::Ticks();
+
+      frees.Record(end - start);
+      failures += error != ObjectAllocator::oaOK;
+      slots[slot] = nullptr;
+    }
+    else
+    {
+      start = OAClock::Ticks();
+      void *block = oa->TryAllocate();
+      end = OAClock::Ticks();
+
+      allocations.Record(end - start);
+      failures += block == nullptr;
+      slots[slot] = block;
+    }
+  }
+
+  for (unsigned i = 0; i < options.Objects; ++i)
+  {
+    if (slots[i])
+      oa->TryFree(slots[i]);
+  }
+
+  print_latency("allocate", allocations);
+  print_latency("free", frees);
+  std::printf("failures: %llu, objects left in use: %u\n", failures, oa->GetStats().ObjectsInUse_);
+
+  bool ok = !failures && !oa->GetStats().ObjectsInUse_;
+  delete oa;
+
+  if (options.Bound > 0.0)
+  {
+    double worst = OAClock::ToNanoseconds(allocations.Max() > frees.Max() ? allocations.Max() : frees.Max());
+
+    std::printf("bound %.0f ns: worst %.0f ns, %s\n", options.Bound, worst,
+      worst <= options.Bound ? "met" : "EXCEEDED");
+    ok = ok && worst <= options.Bound;
+  }
+
+  return ok ? 0 : 1;
+}
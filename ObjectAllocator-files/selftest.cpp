@@ -0,0 +1,1039 @@
+// oa_selftest: regression checks for the allocator and its add-ons
+//
+//   oa_selftest [NAME]
+//
+// Runs every check (or just the one called NAME) and prints one line per
+// check. Each check runs under a watchdog, so one that hangs (a deadlock)
+// is reported and ends the program instead of blocking it. Exits with
+// status 1 if any check fails.
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "HandleAllocator.h"
+#include "ObjectAllocator.h"
+#include "OAPageCache.h"
+#include "OAPageSource.h"
+#include "OATrace.h"
+#include "PRNG.h"
+
+namespace
+{
+  const unsigned WATCHDOG_MS = 10000;
+
+  // Ends the program if a check runs longer than WATCHDOG_MS
+  class Watchdog
+  {
+  public:
+    explicit Watchdog(const char *name) : name_(name), done_(false), thread_(&Watchdog::watch, this)
+    {
+    }
+
+    ~Watchdog()
+    {
+      {
+        std::lock_guard<std::mutex> lock(lock_);
+        done_ = true;
+      }
+      wake_.notify_one();
+      thread_.join();
+    }
+
+  private:
+    void watch()
+    {
+      std::unique_lock<std::mutex> lock(lock_);
+      if (!wake_.wait_for(lock, std::chrono::milliseconds(WATCHDOG_MS), [this] { return done_; }))
+      {
+        std::printf("%-24s HUNG (no result after %u ms)\n", name_, WATCHDOG_MS);
+        std::fflush(stdout);
+        std::_Exit(1);
+      }
+    }
+
+    const char *name_;
+    bool done_;
+    std::mutex lock_;
+    std::condition_variable wake_;
+    std::thread thread_;
+  };
+
+  // One block, reused past the 16-bit use counter: every handle must
+  // resolve while its block is live and go stale once it is freed
+  bool use_count_wrap()
+  {
+    const unsigned REUSES = 0x10000 + 16;
+    OAConfig config(false, 1, 1, false, 0, OAConfig::HeaderBlockInfo(OAConfig::hbExtended));
+    HandleAllocator handles(16, config);
+    HandleAllocator::Handle previous = HandleAllocator::NULL_HANDLE;
+
+    for (unsigned i = 0; i < REUSES; ++i)
+    {
+      HandleAllocator::Handle handle;
+
+      try
+      {
+        handle = handles.AllocateHandle();
+      }
+      catch (const OAException &e)
+      {
+        std::printf("  reuse %u: %s\n", i, e.what());
+        return false;
+      }
+
+      if (!handles.Resolve(handle) || handle == previous)
+      {
+        std::printf("  reuse %u: live handle 0x%08x does not resolve\n", i, handle);
+        return false;
+      }
+      if (previous != HandleAllocator::NULL_HANDLE && handles.Resolve(previous))
+      {
+        std::printf("  reuse %u: stale handle 0x%08x resolves\n", i, previous);
+        return false;
+      }
+
+      handles.FreeHandle(handle);
+      previous = handle;
+    }
+
+    return true;
+  }
+
+  // Pools whose pages and slots leave fewer than 8 generation bits are
+  // refused; at exactly 8 a stale handle stays stale for 255 reuses
+  bool narrow_generation()
+  {
+    const unsigned PER_PAGE = 1024;   // 10 slot bits
+    OAConfig wide(false, PER_PAGE, 1u << 16, false, 0, OAConfig::HeaderBlockInfo(OAConfig::hbExtended));
+    OAConfig fits(false, PER_PAGE, 1u << 14, false, 0, OAConfig::HeaderBlockInfo(OAConfig::hbExtended));
+
+    try
+    {
+      HandleAllocator handles(16, wide);
+      std::printf("  %u generation bits were accepted\n", handles.GenerationBits());
+      return false;
+    }
+    catch (const OAException &e)
+    {
+      if (e.code() != OAException::E_NO_PAGES)
+      {
+        std::printf("  %s\n", e.what());
+        return false;
+      }
+    }
+
+    HandleAllocator handles(16, fits);
+    HandleAllocator::Handle first;
+
+    if (handles.GenerationBits() != 8)
+    {
+      std::printf("  %u generation bits instead of 8\n", handles.GenerationBits());
+      return false;
+    }
+
+    first = handles.AllocateHandle();
+    handles.FreeHandle(first);
+    for (unsigned i = 1; i < 255; ++i)
+    {
+      HandleAllocator::Handle handle;
+
+      handle = handles.AllocateHandle();
+      if (handles.Resolve(first) || handle == first)
+      {
+        std::printf("  stale handle resolves after %u reuses\n", i);
+        return false;
+      }
+      handles.FreeHandle(handle);
+    }
+
+    return true;
+  }
+
+  // Handles into a page that was freed must stay stale when its page index
+  // is reused by a new page
+  bool reused_page_handles()
+  {
+    const unsigned BLOCKS = 4;
+    OAConfig config(false, BLOCKS, 2, false, 0, OAConfig::HeaderBlockInfo(OAConfig::hbExtended));
+    HandleAllocator handles(16, config);
+    HandleAllocator::Handle old[BLOCKS];
+    HandleAllocator::Handle fresh[BLOCKS];
+
+    for (unsigned i = 0; i < BLOCKS; ++i)
+    {
+      old[i] = handles.AllocateHandle();
+    }
+    for (unsigned i = 0; i < BLOCKS; ++i)
+    {
+      handles.FreeHandle(old[i]);
+    }
+    if (handles.Allocator().FreeEmptyPages() != 1)
+    {
+      std::printf("  the empty page was not freed\n");
+      return false;
+    }
+
+    for (unsigned i = 0; i < BLOCKS; ++i)
+    {
+      fresh[i] = handles.AllocateHandle();
+    }
+    for (unsigned i = 0; i < BLOCKS; ++i)
+    {
+      if (handles.Resolve(old[i]))
+      {
+        std::printf("  stale handle 0x%08x resolves on the new page\n", old[i]);
+        return false;
+      }
+      if (!handles.Resolve(fresh[i]))
+      {
+        std::printf("  live handle 0x%08x does not resolve\n", fresh[i]);
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  struct Move
+  {
+    HandleAllocator::Handle From;
+    HandleAllocator::Handle To;
+  };
+
+  struct Moves
+  {
+    Move List[64];
+    unsigned Count;
+  };
+
+  void record_move(HandleAllocator::Handle From, HandleAllocator::Handle To, void *Context)
+  {
+    Moves *moves = static_cast<Moves *>(Context);
+
+    if (moves->Count < sizeof(moves->List) / sizeof(*moves->List))
+    {
+      moves->List[moves->Count].From = From;
+      moves->List[moves->Count].To = To;
+    }
+    ++moves->Count;
+  }
+
+  // Compacts a pool of four pages with one live block on each: three of
+  // them must move onto the remaining page and resolve through the handles
+  // the callback reports
+  bool compact_handles(const OAConfig &config)
+  {
+    const unsigned BLOCKS = 4;
+    const unsigned PAGES = 4;
+    HandleAllocator handles(16, config);
+    HandleAllocator::Handle live[PAGES * BLOCKS];
+    std::vector<HandleAllocator::Handle> kept;
+    Moves moves;
+    unsigned freed;
+
+    for (unsigned i = 0; i < PAGES * BLOCKS; ++i)
+    {
+      live[i] = handles.AllocateHandle();
+    }
+    for (unsigned i = 0; i < PAGES * BLOCKS; ++i)
+    {
+      if (i % BLOCKS)
+      {
+        handles.FreeHandle(live[i]);
+      }
+      else
+      {
+        kept.push_back(live[i]);
+      }
+    }
+
+    moves.Count = 0;
+    freed = handles.Compact(record_move, &moves);
+    if (freed != PAGES - 1 || moves.Count != PAGES - 1)
+    {
+      std::printf("  %u pages freed, %u blocks moved\n", freed, moves.Count);
+      return false;
+    }
+
+    for (unsigned i = 0; i < moves.Count; ++i)
+    {
+      if (std::find(kept.begin(), kept.end(), moves.List[i].From) == kept.end() ||
+        !handles.Resolve(moves.List[i].To))
+      {
+        std::printf("  move 0x%08x -> 0x%08x does not check out\n", moves.List[i].From, moves.List[i].To);
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  // Compact's callback runs under the lock the scavenger gives the pool
+  bool compact_with_scavenger()
+  {
+    OAConfig config(false, 4, 4, false, 0, OAConfig::HeaderBlockInfo(OAConfig::hbExtended));
+
+    config.ScavengeIntervalMs_ = 60000;
+    return compact_handles(config);
+  }
+
+  // The same with the lock a Waitable_ pool takes
+  bool compact_while_waitable()
+  {
+    OAConfig config(false, 4, 4, false, 0, OAConfig::HeaderBlockInfo(OAConfig::hbExtended));
+
+    config.Waitable_ = true;
+    return compact_handles(config);
+  }
+
+  // AllocateWait and AllocateOrQueue on pools that can't wait (a plain pool
+  // and one locked only for its scavenger) try once: a full pool gives
+  // null and oaNoPages, without throwing, blocking or queueing
+  bool full_pool_without_wait()
+  {
+    OAConfig plain(false, 2, 1);
+    OAConfig scavenged(false, 2, 1);
+
+    scavenged.ScavengeIntervalMs_ = 60000;
+
+    const OAConfig *configs[] = { &plain, &scavenged };
+    for (unsigned i = 0; i < sizeof(configs) / sizeof(*configs); ++i)
+    {
+      ObjectAllocator pool(16, *configs[i]);
+      OAWaiter waiter;
+      void *first;
+      void *second;
+
+      waiter.Label = nullptr;
+      waiter.Block = nullptr;
+      waiter.Wake = nullptr;
+      waiter.Context = nullptr;
+
+      first = pool.AllocateWait(0);
+      second = pool.AllocateOrQueue(waiter);
+      if (pool.IsWaitable() || !first || !second)
+      {
+        std::printf("  pool %u: no block from a pool with room\n", i);
+        return false;
+      }
+
+      if (pool.AllocateWait(60000) || pool.LastError() != ObjectAllocator::oaNoPages)
+      {
+        std::printf("  pool %u: AllocateWait on a full pool did not fail with oaNoPages\n", i);
+        return false;
+      }
+      if (pool.AllocateOrQueue(waiter) || pool.LastError() != ObjectAllocator::oaNoPages)
+      {
+        std::printf("  pool %u: AllocateOrQueue on a full pool did not fail with oaNoPages\n", i);
+        return false;
+      }
+
+      // Nobody is queued, so the Free doesn't hand the block to the waiter
+      pool.Free(first);
+      if (waiter.Block)
+      {
+        std::printf("  pool %u: the waiter was queued\n", i);
+        return false;
+      }
+      pool.Free(second);
+    }
+
+    return true;
+  }
+
+  // Every page of a reserved range, a caller's buffer and a real-time pool
+  // starts aligned like new, even when the page size is odd
+  bool region_pages_aligned()
+  {
+    const unsigned PAGES = 3;
+    static std::max_align_t buffer[1024];
+    OAConfig reserved(false, 3, PAGES);
+    OAConfig realtime(false, 3, PAGES);
+
+    reserved.ReserveAddressSpace_ = true;
+    realtime.RealTime_ = true;
+
+    ObjectAllocator reservedpool(13, reserved);
+    ObjectAllocator bufferpool(13, OAConfig(false, 3, PAGES), buffer, sizeof(buffer));
+    ObjectAllocator realtimepool(13, realtime);
+    ObjectAllocator *pools[] = { &reservedpool, &bufferpool, &realtimepool };
+
+    for (unsigned i = 0; i < sizeof(pools) / sizeof(*pools); ++i)
+    {
+      unsigned pages;
+
+      for (unsigned j = 0; j < 3 * PAGES; ++j)
+      {
+        pools[i]->Allocate();
+      }
+
+      pages = 0;
+      for (const GenericObject *page = static_cast<const GenericObject *>(pools[i]->GetPageList()); page;
+        page = page->Next)
+      {
+        if (reinterpret_cast<std::uintptr_t>(page) % alignof(std::max_align_t))
+        {
+          std::printf("  pool %u: page %p is misaligned\n", i, static_cast<const void *>(page));
+          return false;
+        }
+        ++pages;
+      }
+      if (pages != PAGES)
+      {
+        std::printf("  pool %u: %u pages instead of %u\n", i, pages, PAGES);
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  // Compressed links at their widest page: 1-byte objects link by 8-bit
+  // slot, so 255 blocks a page is the limit (256 is refused). Every block
+  // must come back exactly once after frees in shuffled order.
+  bool compressed_full_page()
+  {
+    const unsigned BLOCKS = 255;
+    const unsigned PAGES = 2;
+    OAConfig config(false, BLOCKS, PAGES);
+    std::vector<char *> blocks;
+    Digipen::Utils::PRNG rng(37, 38);
+
+    config.FreeListType_ = OAConfig::flCompressed;
+    try
+    {
+      OAConfig wide(config);
+
+      wide.ObjectsPerPage_ = BLOCKS + 1;
+      ObjectAllocator refused(1, wide);
+      std::printf("  %u blocks a page were accepted\n", BLOCKS + 1);
+      return false;
+    }
+    catch (const OAException &)
+    {
+    }
+
+    ObjectAllocator pool(1, config);
+
+    for (unsigned round = 0; round < 2; ++round)
+    {
+      std::vector<char *> again;
+
+      for (unsigned i = 0; i < BLOCKS * PAGES; ++i)
+      {
+        char *block = static_cast<char *>(pool.Allocate());
+
+        *block = static_cast<char>(i);
+        again.push_back(block);
+      }
+      if (pool.TryAllocate() || pool.LastError() != ObjectAllocator::oaNoPages)
+      {
+        std::printf("  round %u: the full pool handed out another block\n", round);
+        return false;
+      }
+
+      std::sort(again.begin(), again.end());
+      if (std::unique(again.begin(), again.end()) != again.end() || (round && again != blocks))
+      {
+        std::printf("  round %u: blocks handed out twice or lost\n", round);
+        return false;
+      }
+      blocks = again;
+
+      for (unsigned i = BLOCKS * PAGES; i > 1; --i)
+      {
+        std::swap(again[i - 1], again[rng.Below(i)]);
+      }
+      for (unsigned i = 0; i < again.size(); ++i)
+      {
+        pool.Free(again[i]);
+      }
+    }
+
+    return pool.GetStats().FreeObjects_ == BLOCKS * PAGES;
+  }
+
+  // Index stack: Free leaves the block's bytes alone (debugging off), and
+  // DiscardFreeMemory gives back the OS pages under a run of free blocks
+  // while the live blocks around it keep their contents
+  bool index_stack_discard()
+  {
+    const unsigned BLOCKS = 16;
+    const size_t SIZE = 4096;
+    OAConfig config(false, BLOCKS, 1);
+    std::vector<char *> blocks;
+    std::vector<char *> again;
+    size_t discarded;
+
+    config.FreeListType_ = OAConfig::flIndexStack;
+    ObjectAllocator pool(SIZE, config);
+
+    for (unsigned i = 0; i < BLOCKS; ++i)
+    {
+      blocks.push_back(static_cast<char *>(pool.Allocate()));
+      std::memset(blocks.back(), 0xAB, SIZE);
+    }
+    std::sort(blocks.begin(), blocks.end());
+
+    // The middle half goes back; the index stack writes nothing into it
+    for (unsigned i = BLOCKS / 4; i < BLOCKS * 3 / 4; ++i)
+    {
+      pool.Free(blocks[i]);
+      if (static_cast<unsigned char>(blocks[i][0]) != 0xAB ||
+        static_cast<unsigned char>(blocks[i][SIZE - 1]) != 0xAB)
+      {
+        std::printf("  Free wrote into block %u\n", i);
+        return false;
+      }
+    }
+
+    // Eight adjacent 4 KB blocks cover at least seven whole OS pages
+    discarded = pool.DiscardFreeMemory();
+    if (discarded < (BLOCKS / 2 - 1) * SIZE)
+    {
+      std::printf("  %u bytes discarded\n", static_cast<unsigned>(discarded));
+      return false;
+    }
+
+    for (unsigned i = 0; i < BLOCKS; ++i)
+    {
+      bool live = i < BLOCKS / 4 || i >= BLOCKS * 3 / 4;
+
+      for (size_t j = 0; live && j < SIZE; ++j)
+      {
+        if (static_cast<unsigned char>(blocks[i][j]) != 0xAB)
+        {
+          std::printf("  live block %u lost its contents\n", i);
+          return false;
+        }
+      }
+    }
+
+    // The discarded blocks are handed out again and usable
+    for (unsigned i = 0; i < BLOCKS / 2; ++i)
+    {
+      again.push_back(static_cast<char *>(pool.Allocate()));
+      std::memset(again.back(), 0xCD, SIZE);
+    }
+    std::sort(again.begin(), again.end());
+    if (!std::equal(again.begin(), again.end(), blocks.begin() + BLOCKS / 4))
+    {
+      std::printf("  other blocks came back than were freed\n");
+      return false;
+    }
+
+    return true;
+  }
+
+  // The page of pool that holds block (null if none does)
+  const void *page_of(const ObjectAllocator &pool, const void *block)
+  {
+    const char *address = static_cast<const char *>(block);
+    size_t size = pool.GetStats().PageSize_;
+
+    for (const GenericObject *page = static_cast<const GenericObject *>(pool.GetPageList()); page;
+      page = page->Next)
+    {
+      const char *start = reinterpret_cast<const char *>(page);
+
+      if (start <= address && address < start + size)
+      {
+        return page;
+      }
+    }
+    return nullptr;
+  }
+
+  // apFullestPage: with three pages holding 7, 4 and 1 live blocks of 8,
+  // new blocks fill the fullest page first, then the next. Fragmentation_
+  // counts the free blocks on pages that still hold objects.
+  bool fullest_page_first()
+  {
+    const unsigned BLOCKS = 8;
+    const unsigned LIVE[] = { 7, 4, 1 };
+    OAConfig config(false, BLOCKS, 3);
+    std::vector<void *> blocks[3];
+    const void *pages[3];
+    double fragmentation;
+
+    config.AllocPolicy_ = OAConfig::apFullestPage;
+    ObjectAllocator pool(16, config);
+
+    // A fresh pool fills one page after the other
+    for (unsigned i = 0; i < 3 * BLOCKS; ++i)
+    {
+      void *block = pool.Allocate();
+
+      pages[i / BLOCKS] = page_of(pool, block);
+      blocks[i / BLOCKS].push_back(block);
+    }
+    for (unsigned page = 0; page < 3; ++page)
+    {
+      while (blocks[page].size() > LIVE[page])
+      {
+        pool.Free(blocks[page].back());
+        blocks[page].pop_back();
+      }
+    }
+
+    // 12 of 24 blocks free, none on an empty page
+    fragmentation = pool.GetStats().Fragmentation_;
+    if (fragmentation < 0.49 || fragmentation > 0.51)
+    {
+      std::printf("  fragmentation %.3f instead of 0.5\n", fragmentation);
+      return false;
+    }
+
+    // One block tops up the fullest page, the next four the middle one
+    for (unsigned i = 0; i < 1 + 4; ++i)
+    {
+      unsigned expected = i < 1 ? 0 : 1;
+
+      if (page_of(pool, pool.Allocate()) != pages[expected])
+      {
+        std::printf("  block %u did not come from page %u\n", i, expected);
+        return false;
+      }
+    }
+
+    // The last live block of the sparsest page goes: its page is empty, so
+    // no free block counts as stranded any more
+    pool.Free(blocks[2].back());
+    fragmentation = pool.GetStats().Fragmentation_;
+    if (fragmentation != 0.0)
+    {
+      std::printf("  fragmentation %.3f instead of 0\n", fragmentation);
+      return false;
+    }
+
+    return true;
+  }
+
+  // A pool capped at one page of two blocks sends the next three to the
+  // overflow source; stats count them and a refused free changes nothing
+  bool overflow_counts(ObjectAllocator &pool, ObjectAllocator *shared)
+  {
+    std::vector<void *> blocks;
+    OAStats stats;
+
+    for (unsigned i = 0; i < 5; ++i)
+    {
+      blocks.push_back(pool.Allocate());
+    }
+    pool.Free(blocks[0]);
+    pool.Free(blocks[2]);
+
+    stats = pool.GetStats();
+    if (stats.OverflowInUse_ != 2 || stats.OverflowAllocations_ != 3 ||
+        stats.ObjectsInUse_ != 3 || stats.Allocations_ != 5 || stats.Deallocations_ != 2)
+    {
+      std::printf("  overflow %u in use of %u, %u in use, %u/%u allocations/frees\n",
+        stats.OverflowInUse_, stats.OverflowAllocations_, stats.ObjectsInUse_,
+        stats.Allocations_, stats.Deallocations_);
+      return false;
+    }
+
+    // Behind the pool's back, the shared pool gets the block already: the
+    // pool's free fails and the block stays an overflow object
+    if (shared)
+    {
+      bool thrown = false;
+
+      shared->Free(blocks[3]);
+      try
+      {
+        pool.Free(blocks[3]);
+      }
+      catch (const OAException &e)
+      {
+        thrown = e.code() == OAException::E_MULTIPLE_FREE;
+      }
+
+      stats = pool.GetStats();
+      if (!thrown || stats.OverflowInUse_ != 2 || stats.ObjectsInUse_ != 3 ||
+          stats.Deallocations_ != 2)
+      {
+        std::printf("  refused free: %s, %u overflow in use, %u in use, %u frees\n",
+          thrown ? "thrown" : "not thrown", stats.OverflowInUse_, stats.ObjectsInUse_,
+          stats.Deallocations_);
+        return false;
+      }
+
+      // Taken back, the last freed block is the same one again
+      if (shared->Allocate() != blocks[3])
+      {
+        std::printf("  the shared pool did not hand the block back\n");
+        return false;
+      }
+    }
+
+    pool.Free(blocks[1]);
+    pool.Free(blocks[3]);
+    pool.Free(blocks[4]);
+    stats = pool.GetStats();
+    if (stats.OverflowInUse_ || stats.ObjectsInUse_ || stats.Deallocations_ != 5)
+    {
+      std::printf("  %u overflow and %u objects left, %u frees\n",
+        stats.OverflowInUse_, stats.ObjectsInUse_, stats.Deallocations_);
+      return false;
+    }
+    if (shared && shared->GetStats().ObjectsInUse_)
+    {
+      std::printf("  %u objects left in the shared pool\n", shared->GetStats().ObjectsInUse_);
+      return false;
+    }
+
+    return true;
+  }
+
+  bool overflow_to_heap()
+  {
+    OAConfig config(false, 2, 1);
+
+    config.OverflowMode_ = OAConfig::ofHeap;
+    ObjectAllocator pool(16, config);
+
+    return overflow_counts(pool, nullptr);
+  }
+
+  bool overflow_to_pool()
+  {
+    OAConfig config(false, 2, 1);
+    ObjectAllocator shared(16, OAConfig(false, 4, 0, true));
+
+    config.OverflowMode_ = OAConfig::ofPool;
+    config.OverflowPool_ = &shared;
+    ObjectAllocator pool(16, config);
+
+    return overflow_counts(pool, &shared);
+  }
+
+  // Failures are kept per thread: one thread's error never shows up as
+  // another's LastError or exception on a shared pool
+  bool per_thread_errors()
+  {
+    OAConfig config(false, 1, 1, true);
+    void *block;
+    ObjectAllocator::OA_ERROR before = ObjectAllocator::oaOK;
+    ObjectAllocator::OA_ERROR after = ObjectAllocator::oaOK;
+    bool thrown = false;
+
+    config.Waitable_ = true;
+    ObjectAllocator pool(16, config);
+
+    block = pool.Allocate();
+    pool.Free(block);
+    if (pool.TryFree(block) != ObjectAllocator::oaMultipleFree)
+    {
+      std::printf("  the double free was not caught\n");
+      return false;
+    }
+    block = pool.Allocate();
+
+    std::thread other([&]()
+    {
+      before = pool.LastError();
+      if (!pool.TryAllocate())
+      {
+        after = pool.LastError();
+      }
+      try
+      {
+        pool.Allocate();
+      }
+      catch (const OAException &e)
+      {
+        thrown = e.code() == OAException::E_NO_PAGES;
+      }
+    });
+    other.join();
+
+    if (before != ObjectAllocator::oaOK || after != ObjectAllocator::oaNoPages || !thrown)
+    {
+      std::printf("  other thread: error %d before, %d after its failure, %s\n",
+        before, after, thrown ? "E_NO_PAGES" : "no E_NO_PAGES");
+      return false;
+    }
+    if (pool.LastError() != ObjectAllocator::oaMultipleFree)
+    {
+      std::printf("  this thread's error became %d\n", pool.LastError());
+      return false;
+    }
+
+    pool.Free(block);
+    return true;
+  }
+
+  // Pages a pool gives back on a thread sit in that thread's cache, and go
+  // to the global lists when the thread exits
+  bool page_cache_thread_exit()
+  {
+    OAConfig config(false, 16, 0);
+    size_t span = 0;
+    size_t during = 0;
+
+    config.UsePageCache_ = true;
+    OAPageCache::Trim();
+
+    std::thread other([&]()
+    {
+      ObjectAllocator *pool = new ObjectAllocator(64, config);
+
+      pool->Free(pool->Allocate());
+      span = OAPageCache::SpanSize(pool->GetStats().PageSize_);
+      delete pool;
+      during = OAPageCache::CachedBytes();
+    });
+    other.join();
+
+    if (during)
+    {
+      std::printf("  %zu bytes went global while the thread was alive\n", during);
+      return false;
+    }
+    if (OAPageCache::CachedBytes() != span)
+    {
+      std::printf("  %zu bytes cached after the thread exited, expected %zu\n",
+        OAPageCache::CachedBytes(), span);
+      return false;
+    }
+
+    OAPageCache::Trim();
+    return true;
+  }
+
+  // A pool on a caller's buffer turns off every mode that would reach the
+  // heap after construction; a full pool just reports oaNoPages
+  bool buffer_mode_modes_off()
+  {
+    static std::max_align_t buffer[64];
+    OAConfig config(false, 4, 0);
+    ObjectAllocator shared(16, OAConfig(false, 4, 0));
+    OATraceRecorder recorder("/dev/null");
+    OAConfig effective;
+    std::vector<void *> blocks;
+    void *block;
+
+    config.OverflowMode_ = OAConfig::ofPool;
+    config.OverflowPool_ = &shared;
+    config.Waitable_ = true;
+    config.TraceRecorder_ = &recorder;
+    ObjectAllocator pool(16, config, buffer, sizeof(buffer));
+
+    effective = pool.GetConfig();
+    if (effective.OverflowMode_ != OAConfig::ofNone || effective.Waitable_ || effective.TraceRecorder_)
+    {
+      std::printf("  overflow %d, waitable %d, trace %p still on\n", effective.OverflowMode_,
+        effective.Waitable_, static_cast<void *>(effective.TraceRecorder_));
+      return false;
+    }
+
+    // The buffer holds a few pages: past them nothing overflows
+    while (blocks.size() < 1000 && (block = pool.TryAllocate()) != nullptr)
+    {
+      blocks.push_back(block);
+    }
+    if (blocks.size() != 4 * pool.GetConfig().MaxPages_ ||
+        pool.LastError() != ObjectAllocator::oaNoPages || shared.GetStats().ObjectsInUse_)
+    {
+      std::printf("  %zu blocks, error %d, %u overflowed\n", blocks.size(), pool.LastError(),
+        shared.GetStats().ObjectsInUse_);
+      return false;
+    }
+
+    for (size_t i = 0; i < blocks.size(); ++i)
+    {
+      pool.Free(blocks[i]);
+    }
+    return true;
+  }
+
+  // Forwards to another page source and counts the bytes out on loan
+  class CountingPages : public OAPageSource
+  {
+  public:
+    explicit CountingPages(OAPageSource &Source) : source_(Source), out_(0) {}
+
+    size_t Out(void) const { return out_; }
+
+    void *Acquire(size_t bytes, size_t alignment)
+    {
+      void *span = source_.Acquire(bytes, alignment);
+
+      out_ += span ? bytes : 0;
+      return span;
+    }
+
+    void Release(void *span, size_t bytes, size_t alignment)
+    {
+      out_ -= bytes;
+      source_.Release(span, bytes, alignment);
+    }
+
+  private:
+    OAPageSource &source_;
+    size_t out_;
+  };
+
+  // Fills four pages from source, empties them, and checks FreeEmptyPages
+  // hands every page back (and the destructor whatever is left)
+  bool pages_come_back(const char *name, OAPageSource &source)
+  {
+    const unsigned BLOCKS = 8;
+    CountingPages counting(source);
+    OAConfig config(false, BLOCKS, 0);
+    std::vector<void *> blocks;
+    unsigned freed;
+
+    config.PageSource_ = &counting;
+    {
+      ObjectAllocator pool(64, config);
+
+      for (unsigned round = 0; round < 2; ++round)
+      {
+        for (unsigned i = 0; i < 4 * BLOCKS; ++i)
+        {
+          blocks.push_back(pool.Allocate());
+        }
+        for (size_t i = 0; i < blocks.size(); ++i)
+        {
+          pool.Free(blocks[i]);
+        }
+        blocks.clear();
+
+        freed = pool.FreeEmptyPages();
+        if (!freed || pool.GetStats().PagesInUse_ ||
+            counting.Out() != pool.GetStats().PagesInUse_ * pool.GetStats().PageSize_)
+        {
+          std::printf("  %s: %u pages freed, %u left, %zu bytes still out\n", name, freed,
+            pool.GetStats().PagesInUse_, counting.Out());
+          return false;
+        }
+      }
+    }
+
+    if (counting.Out())
+    {
+      std::printf("  %s: %zu bytes out after the pool went\n", name, counting.Out());
+      return false;
+    }
+    return true;
+  }
+
+  // Every built-in page source gets pages back from FreeEmptyPages; the
+  // buffer source reuses them rather than carving more
+  bool page_sources_release()
+  {
+    static std::max_align_t buffer[4096];
+    const char *FILE_NAME = "oa_selftest.pages";
+    OAHeapPages heap;
+    OACachedPages cached;
+    OAMmapPages mapped;
+    OAHugePages huge(true);
+    OAFilePages file(FILE_NAME);
+    OASharedPages shared("oa_selftest_pages", 1 << 22);
+    OABufferPages carved(buffer, sizeof(buffer));
+    size_t used;
+    bool ok;
+
+    ok = pages_come_back("heap", heap) && pages_come_back("cached", cached) &&
+      pages_come_back("mmap", mapped) && pages_come_back("huge", huge);
+    if (ok && file.IsOpen())
+    {
+      ok = pages_come_back("file", file);
+    }
+    std::remove(FILE_NAME);
+    if (ok && shared.IsOpen())
+    {
+      ok = pages_come_back("shared", shared);
+    }
+    if (!ok || !pages_come_back("buffer", carved))
+    {
+      return false;
+    }
+
+    // The second run took the spans the first one released
+    used = carved.Used();
+    if (!pages_come_back("buffer", carved) || carved.Used() != used)
+    {
+      std::printf("  buffer: %zu bytes carved, %zu before\n", carved.Used(), used);
+      return false;
+    }
+
+    return true;
+  }
+
+  struct Check
+  {
+    const char *Name;
+    bool (*Run)(void);
+  };
+
+  const Check CHECKS[] =
+  {
+    { "use_count_wrap", use_count_wrap },
+    { "narrow_generation", narrow_generation },
+    { "reused_page_handles", reused_page_handles },
+    { "compact_with_scavenger", compact_with_scavenger },
+    { "compact_while_waitable", compact_while_waitable },
+    { "full_pool_without_wait", full_pool_without_wait },
+    { "region_pages_aligned", region_pages_aligned },
+    { "compressed_full_page", compressed_full_page },
+    { "index_stack_discard", index_stack_discard },
+    { "fullest_page_first", fullest_page_first },
+    { "overflow_to_heap", overflow_to_heap },
+    { "overflow_to_pool", overflow_to_pool },
+    { "per_thread_errors", per_thread_errors },
+    { "page_cache_thread_exit", page_cache_thread_exit },
+    { "buffer_mode_modes_off", buffer_mode_modes_off },
+    { "page_sources_release", page_sources_release },
+  };
+}
+
+int main(int argc, char **argv)
+{
+  const char *only = argc > 1 ? argv[1] : nullptr;
+  unsigned failures = 0;
+  unsigned run = 0;
+
+  for (size_t i = 0; i < sizeof(CHECKS) / sizeof(*CHECKS); ++i)
+  {
+    bool ok;
+
+    if (only && std::strcmp(only, CHECKS[i].Name))
+      continue;
+
+    {
+      Watchdog watchdog(CHECKS[i].Name);
+      try
+      {
+        ok = CHECKS[i].Run();
+      }
+      catch (const OAException &e)
+      {
+        std::printf("  %s\n", e.what());
+        ok = false;
+      }
+    }
+
+    std::printf("%-24s %s\n", CHECKS[i].Name, ok ? "ok" : "FAILED");
+    failures += !ok;
+    ++run;
+  }
+
+  if (!run)
+  {
+    std::printf("usage: oa_selftest [NAME]\n");
+    return 2;
+  }
+
+  return failures ? 1 : 0;
+}
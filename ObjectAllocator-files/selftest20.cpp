@@ -0,0 +1,187 @@
+// oa_selftest20: checks for the C++20 coroutine support (OACoroutine.h)
+//
+//   oa_selftest20
+//
+// Built with -std=c++20 so OA_COROUTINES is on. Prints one line per check
+// and exits with status 1 if any check fails.
+
+#include <coroutine>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include "OACoroutine.h"
+
+namespace
+{
+  // Runs posted coroutines when asked, on the calling thread
+  class QueueExecutor : public OAExecutor
+  {
+  public:
+    void Post(std::coroutine_handle<> handle) { ready_.push_back(handle); }
+
+    unsigned RunAll(void)
+    {
+      unsigned resumed = 0;
+
+      while (!ready_.empty())
+      {
+        std::coroutine_handle<> handle = ready_.front();
+        ready_.pop_front();
+        handle.resume();
+        ++resumed;
+      }
+      return resumed;
+    }
+
+  private:
+    std::deque<std::coroutine_handle<> > ready_;
+  };
+
+  // Fire-and-forget coroutine whose frame comes from an OAFramePool
+  struct Task
+  {
+    struct promise_type : OAFramePool<256>
+    {
+      Task get_return_object(void) { return Task(); }
+      std::suspend_never initial_suspend(void) { return {}; }
+      std::suspend_never final_suspend(void) noexcept { return {}; }
+      void return_void(void) {}
+      void unhandled_exception(void) {}
+    };
+  };
+
+  Task allocate_into(ObjectAllocator &pool, OAExecutor &executor, void *&block)
+  {
+    block = co_await pool.AllocateAsync(executor);
+  }
+
+  // Frames come from the pool, aligned like new, and go back to it. The
+  // pool keeps index stacks without debugging, so a delete stays cheap.
+  bool frames_from_pool()
+  {
+    ObjectAllocator &pool = OAFramePool<256>::Pool();
+    unsigned before = pool.GetStats().Allocations_;
+    void *block = nullptr;
+    ObjectAllocator blocks(16, OAConfig(false, 2, 1));
+    QueueExecutor executor;
+
+    if (pool.GetConfig().FreeListType_ != OAConfig::flIndexStack || pool.GetConfig().DebugOn_)
+    {
+      std::printf("  the frame pool doesn't use index stacks with debugging off\n");
+      return false;
+    }
+
+    for (unsigned i = 0; i < 100; ++i)
+    {
+      allocate_into(blocks, executor, block);
+      blocks.Free(block);
+    }
+
+    if (pool.GetStats().Allocations_ - before != 100 || pool.GetStats().ObjectsInUse_)
+    {
+      std::printf("  %u frames from the pool, %u still in use\n",
+        pool.GetStats().Allocations_ - before, pool.GetStats().ObjectsInUse_);
+      return false;
+    }
+
+    // The pool's next block is the frame the next coroutine gets
+    void *frame = pool.Allocate();
+    bool aligned = reinterpret_cast<std::uintptr_t>(frame) % alignof(std::max_align_t) == 0;
+    pool.Free(frame);
+    if (!aligned)
+    {
+      std::printf("  frame %p is not aligned to max_align_t\n", frame);
+      return false;
+    }
+
+    return true;
+  }
+
+  // A full Waitable_ pool suspends the coroutine until a Free serves it
+  bool async_waits_for_free()
+  {
+    OAConfig config(false, 1, 1);
+    QueueExecutor executor;
+    void *first;
+    void *second = nullptr;
+
+    config.Waitable_ = true;
+    ObjectAllocator pool(16, config);
+
+    first = pool.Allocate();
+    allocate_into(pool, executor, second);
+    if (second || executor.RunAll())
+    {
+      std::printf("  the coroutine did not wait\n");
+      return false;
+    }
+
+    pool.Free(first);
+    if (executor.RunAll() != 1 || second != first)
+    {
+      std::printf("  the Free did not hand the block to the coroutine\n");
+      return false;
+    }
+
+    pool.Free(second);
+    return true;
+  }
+
+  // Without Waitable_ a full pool completes the await at once with null
+  bool async_without_wait()
+  {
+    ObjectAllocator pool(16, OAConfig(false, 1, 1));
+    QueueExecutor executor;
+    void *first;
+    void *second = &executor;
+
+    first = pool.Allocate();
+    allocate_into(pool, executor, second);
+    if (second || pool.LastError() != ObjectAllocator::oaNoPages)
+    {
+      std::printf("  the await did not complete with null\n");
+      return false;
+    }
+
+    pool.Free(first);
+    return true;
+  }
+
+  struct Check
+  {
+    const char *Name;
+    bool (*Run)(void);
+  };
+
+  const Check CHECKS[] =
+  {
+    { "frames_from_pool", frames_from_pool },
+    { "async_waits_for_free", async_waits_for_free },
+    { "async_without_wait", async_without_wait },
+  };
+}
+
+int main()
+{
+  unsigned failures = 0;
+
+  for (const Check &check : CHECKS)
+  {
+    bool ok;
+
+    try
+    {
+      ok = check.Run();
+    }
+    catch (const OAException &e)
+    {
+      std::printf("  %s\n", e.what());
+      ok = false;
+    }
+
+    std::printf("%-24s %s\n", check.Name, ok ? "ok" : "FAILED");
+    failures += !ok;
+  }
+
+  return failures ? 1 : 0;
+}